@@ -49,7 +49,7 @@ HDEVINFO                            deviceInfoList;
 SP_DEVICE_INTERFACE_DATA            deviceInfo;
 SP_DEVICE_INTERFACE_DETAIL_DATA     *deviceDetails = NULL;
 DWORD                               size;
-int                                 i, openFlag = 0;  /* may be FILE_FLAG_OVERLAPPED */
+int                                 i, openFlag = FILE_FLAG_OVERLAPPED;  /* for usbhidReadInput() timeouts */
 int                                 errorCode = USBOPEN_ERR_NOTFOUND;
 HANDLE                              handle = INVALID_HANDLE_VALUE;
 HIDD_ATTRIBUTES                     deviceAttributes;
@@ -156,6 +156,35 @@ BOOLEAN rval = 0;
 
 /* ------------------------------------------------------------------------ */
 
+int usbhidReadInput(usbDevice_t *device, char *buffer, int *len, int timeout)
+{
+OVERLAPPED  overlapped;
+DWORD       bytesRead;
+int         errorCode = USBOPEN_ERR_IO;
+
+    ZeroMemory(&overlapped, sizeof(overlapped));
+    if((overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL)) == NULL)
+        return USBOPEN_ERR_IO;
+    if(!ReadFile((HANDLE)device, buffer, *len, &bytesRead, &overlapped)){
+        if(GetLastError() != ERROR_IO_PENDING)
+            goto done;
+        if(WaitForSingleObject(overlapped.hEvent, timeout) != WAIT_OBJECT_0){
+            CancelIo((HANDLE)device);   /* timed out: drop the read */
+            GetOverlappedResult((HANDLE)device, &overlapped, &bytesRead, TRUE);
+            goto done;
+        }
+    }
+    if(GetOverlappedResult((HANDLE)device, &overlapped, &bytesRead, FALSE)){
+        *len = bytesRead;
+        errorCode = 0;
+    }
+done:
+    CloseHandle(overlapped.hEvent);
+    return errorCode;
+}
+
+/* ------------------------------------------------------------------------ */
+
 /* ######################################################################## */
 #else /* defined WIN32 #################################################### */
 /* ######################################################################## */
@@ -319,6 +348,40 @@ int bytesReceived, maxLen = *len;
     return 0;
 }
 
+/* ------------------------------------------------------------------------- */
+
+int usbhidReadInput(usbDevice_t *device, char *buffer, int *len, int timeout)
+{
+int bytesReceived, maxLen = *len;
+static int  didClaim = 0;
+
+    if(!didClaim){
+#ifdef LIBUSB_HAS_DETACH_KERNEL_DRIVER_NP
+        usb_detach_kernel_driver_np((void *)device, 0);    /* fails harmlessly if no driver is bound */
+#endif
+        if(usb_claim_interface((void *)device, 0) != 0){
+            fprintf(stderr, "Error claiming interface: %s\n", usb_strerror());
+            return USBOPEN_ERR_ACCESS;
+        }
+        didClaim = 1;
+    }
+    if(!usesReportIDs){
+        buffer++;   /* make room for dummy report ID */
+        maxLen--;
+    }
+    bytesReceived = usb_interrupt_read((void *)device, USB_ENDPOINT_IN | 1, buffer, maxLen, timeout);
+    if(bytesReceived < 0){
+        fprintf(stderr, "Error reading interrupt endpoint: %s\n", usb_strerror());
+        return USBOPEN_ERR_IO;
+    }
+    *len = bytesReceived;
+    if(!usesReportIDs){
+        buffer[-1] = 0;  /* add dummy report ID */
+        (*len)++;
+    }
+    return 0;
+}
+
 /* ######################################################################## */
 #endif /* defined WIN32 ################################################### */
 /* ######################################################################## */
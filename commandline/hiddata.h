@@ -66,6 +66,15 @@ int usbhidGetReport(usbDevice_t *device, int reportID, char *buffer, int *len);
  * Returns: 0 on success, an error code otherwise.
  */
 
+int usbhidReadInput(usbDevice_t *device, char *buffer, int *len, int timeout);
+/* This function waits up to 'timeout' milliseconds for an input report on
+ * the interrupt-in endpoint. 'buffer' and 'len' are used as for
+ * usbhidGetReport(). With libusb the first call takes the interface over
+ * from the kernel's HID driver, where the platform allows this.
+ * Returns: 0 on success, an error code otherwise. Running out of time is
+ * reported as USBOPEN_ERR_IO.
+ */
+
 /* ------------------------------------------------------------------------ */
 
 #endif /* __HIDDATA_H_INCLUDED__ */
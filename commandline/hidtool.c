@@ -11,10 +11,29 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
 #include "hiddata.h"
 #include "../firmware/usbconfig.h"  /* for device VID, PID, vendor name and product name */
 #include "../firmware/config.h"
 
+/* the most data bytes, command byte included, one data report can carry.
+ * Without long transfers this is 254, less the report ID. The device says
+ * which it was built with in REPORT_CAPS, see readCaps().
+ */
+#define SHORT_TRANSFER  253
+#define MAX_TRANSFER    1024
+
+/* What the device supports, from REPORT_CAPS. A device which cannot say
+ * gets short transfers, and is sent every command.
+ */
+static unsigned char    caps[CAPS_SIZE];
+static int              haveCaps;
+static int              maxTransfer = SHORT_TRANSFER;
+static unsigned long    commands = ~0UL;
+
+#define SUPPORTS(cmd)   (commands & (1UL << (cmd)))
+
 /* ------------------------------------------------------------------------- */
 
 static char *usbErrorMessage(int errCode)
@@ -41,7 +60,7 @@ int             vid = rawVid[0] + 256 * rawVid[1];
 int             pid = rawPid[0] + 256 * rawPid[1];
 int             err;
 
-    if((err = usbhidOpenDevice(&dev, vid, vendorName, pid, productName, 0)) != 0){
+    if((err = usbhidOpenDevice(&dev, vid, vendorName, pid, productName, 1)) != 0){
         fprintf(stderr, "error finding %s: %s\n", productName, usbErrorMessage(err));
         return NULL;
     }
@@ -83,20 +102,229 @@ int     pos = 0;
 
 /* ------------------------------------------------------------------------- */
 
+/* Fetches the device's status report into status, which must hold
+ * STATUS_SIZE bytes. Fields older firmware does not send are 0xff.
+ */
+static int  readStatus(usbDevice_t *dev, unsigned char *status)
+{
+char    buffer[STATUS_SIZE + 1];
+int     err, len = sizeof(buffer);
+
+    if((err = usbhidGetReport(dev, REPORT_STATUS, buffer, &len)) != 0)
+        return err;
+    if(len < 1 + STATUS_STACK || len > sizeof(buffer))
+        return USBOPEN_ERR_IO;
+    memset(status, 0xff, STATUS_SIZE);
+    memcpy(status, buffer + 1, len - 1);
+    return 0;
+}
+
+#define STATUS_WORD(status, field)  ((status)[field] | (status)[(field) + 1] << 8)
+
+/* Waits until the device has written all queued data to EEPROM, and
+ * returns the final status report in status.
+ */
+static int  flush(usbDevice_t *dev, unsigned char *status)
+{
+int     err;
+
+    while((err = readStatus(dev, status)) == 0 && status[STATUS_PENDING] != 0)
+        usleep(10000);
+    return err;
+}
+
+/* Reads REPORT_CAPS, and picks the transfer size and commands to use from
+ * it. Called once the device is open.
+ */
+static void readCaps(usbDevice_t *dev)
+{
+char    buffer[CAPS_SIZE + 1];
+int     len = sizeof(buffer);
+
+    if(usbhidGetReport(dev, REPORT_CAPS, buffer, &len) != 0 ||
+       len != sizeof(buffer) || buffer[0] != REPORT_CAPS)
+        return;
+    memcpy(caps, buffer + 1, CAPS_SIZE);
+    haveCaps = 1;
+    maxTransfer = STATUS_WORD(caps, CAPS_TRANSFER);
+    if(maxTransfer > MAX_TRANSFER)
+        maxTransfer = MAX_TRANSFER;
+    commands = (unsigned long)caps[CAPS_COMMANDS] |
+               (unsigned long)caps[CAPS_COMMANDS + 1] << 8 |
+               (unsigned long)caps[CAPS_COMMANDS + 2] << 16 |
+               (unsigned long)caps[CAPS_COMMANDS + 3] << 24;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Works out the CRC of len bytes at offset on the device, see CMD_CRC */
+static int  deviceCrc(usbDevice_t *dev, int offset, int len, unsigned *crc)
+{
+char    buffer[CRC_SIZE + 1];
+int     err, n;
+
+    buffer[0] = REPORT_COMMAND;
+    buffer[1] = CMD_CRC;
+    buffer[2] = offset & 0xff;
+    buffer[3] = offset >> 8;
+    buffer[4] = len & 0xff;
+    buffer[5] = len >> 8;
+    if((err = usbhidSetReport(dev, buffer, 6)) != 0)
+        return err;
+    do{
+        n = sizeof(buffer);
+        if((err = usbhidGetReport(dev, REPORT_CRC, buffer, &n)) != 0)
+            return err;
+        if(n != sizeof(buffer))
+            return USBOPEN_ERR_IO;
+    }while(STATUS_WORD((unsigned char *)buffer + 1, CRC_LEFT) != 0);
+    *crc = STATUS_WORD((unsigned char *)buffer + 1, CRC_VALUE);
+    return 0;
+}
+
+/* The same CRC as the device, see CMD_CRC */
+static unsigned crc16(char *data, int len)
+{
+unsigned    crc = CRC_INIT;
+int         i;
+
+    while(len-- > 0){
+        crc ^= *data++ & 0xff;
+        for(i = 0; i < 8; i++)
+            crc = crc & 1 ? (crc >> 1) ^ 0xa001 : crc >> 1;
+    }
+    return crc;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static double   now(void)
+{
+struct timeval  tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Reads len bytes of EEPROM from offset into data with READ_AT, at most
+ * chunk bytes per report.
+ */
+static int  readImage(usbDevice_t *dev, char *data, int offset, int len, int chunk)
+{
+char    buffer[MAX_TRANSFER + 1];
+int     err, i, n;
+
+    for(i = 0; i < len; i += n){
+        n = len - i < chunk ? len - i : chunk;
+        buffer[0] = REPORT_COMMAND;
+        buffer[1] = CMD_READ_AT;
+        buffer[2] = (offset + i) & 0xff;
+        buffer[3] = (offset + i) >> 8;
+        if((err = usbhidSetReport(dev, buffer, 4)) != 0)
+            return err;
+        n += 1;
+        if((err = usbhidGetReport(dev, REPORT_DATA, buffer, &n)) != 0)
+            return err;
+        if(--n <= 0)
+            return USBOPEN_ERR_IO;
+        memcpy(data + i, buffer + 1, n);
+    }
+    return 0;
+}
+
+/* Writes len bytes of data to EEPROM at offset with WRITE_AT, at most chunk
+ * bytes per report, the command and offset included.
+ */
+static int  writeImage(usbDevice_t *dev, char *data, int offset, int len, int chunk)
+{
+char    buffer[MAX_TRANSFER + 1];
+int     err, i, n;
+
+    for(i = 0; i < len; i += n){
+        n = len - i < chunk - 3 ? len - i : chunk - 3;
+        buffer[0] = REPORT_DATA;
+        buffer[1] = CMD_WRITE_AT;
+        buffer[2] = (offset + i) & 0xff;
+        buffer[3] = (offset + i) >> 8;
+        memcpy(buffer + 4, data + i, n);
+        if((err = usbhidSetReport(dev, buffer, n + 4)) != 0)
+            return err;
+    }
+    return 0;
+}
+
+/* Times a read of the whole EEPROM and writing it back unchanged, in reports
+ * of at most chunk bytes. Unchanged bytes are never programmed, so this
+ * measures the USB transfers alone.
+ */
+static int  bench(usbDevice_t *dev, int chunk)
+{
+char            image[EEPROM_SIZE];
+unsigned char   status[STATUS_SIZE];
+double          start, t;
+int             err;
+
+    start = now();
+    if((err = readImage(dev, image, 0, EEPROM_SIZE, chunk)) != 0)
+        return err;
+    t = now() - start;
+    printf("%4d byte reports: read %d bytes in %.1f ms, %.0f bytes/s\n",
+        chunk, EEPROM_SIZE, t * 1000, EEPROM_SIZE / t);
+    start = now();
+    if((err = writeImage(dev, image, 0, EEPROM_SIZE, chunk)) != 0 ||
+       (err = flush(dev, status)) != 0)
+        return err;
+    t = now() - start;
+    printf("%4d byte reports: wrote %d bytes in %.1f ms, %.0f bytes/s\n",
+        chunk, EEPROM_SIZE, t * 1000, EEPROM_SIZE / t);
+    if(STATUS_WORD(status, STATUS_WRITTEN) != 0)
+        printf("warning: %u bytes changed while benchmarking\n", STATUS_WORD(status, STATUS_WRITTEN));
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
 static void usage(char *myName)
 {
     fprintf(stderr, "usage:\n");
     fprintf(stderr, "  %s read <bytes to read>\n", myName);
     fprintf(stderr, "  %s write <list of bytes separated by ,>\n", myName);
-    fprintf(stderr, "  %s goto <block # as uint8> \n", myName);
+    fprintf(stderr, "  %s readat <EEPROM offset> <bytes to read>\n", myName);
+    fprintf(stderr, "  %s writeat <EEPROM offset> <list of bytes separated by ,>\n", myName);
+    fprintf(stderr, "  %s goto <block # in sequence> [crossfade]\n", myName);
+    fprintf(stderr, "  %s gotoseq <sequence ID> [crossfade]\n", myName);
+    fprintf(stderr, "  %s writeseq <sequence ID> <start offset> <flags> <list of bytes separated by ,>\n", myName);
+    fprintf(stderr, "  %s writeflash <offset> <list of bytes separated by ,>\n", myName);
+    fprintf(stderr, "  %s speed <playback speed, 1.0 is normal>\n", myName);
+    fprintf(stderr, "  %s pause\n", myName);
+    fprintf(stderr, "  %s resume\n", myName);
+    fprintf(stderr, "  %s step\n", myName);
+    fprintf(stderr, "  %s seek <units of 20ms from the start of the sequence>\n", myName);
+    fprintf(stderr, "  %s overlay <sequence ID, 255 to stop> [blend mode] [alpha]\n", myName);
+    fprintf(stderr, "  %s batch <command,data bytes separated by ,> ...\n", myName);
+    fprintf(stderr, "  %s live <red> <green> <blue> [fade]\n", myName);
+    fprintf(stderr, "  %s live -    (one frame of red green blue [fade] per line of stdin)\n", myName);
+    fprintf(stderr, "  %s patch <track> <red> <green> <blue> <duration>\n", myName);
+    fprintf(stderr, "  %s persist\n", myName);
+    fprintf(stderr, "  %s block\n", myName);
     fprintf(stderr, "  %s restart\n", myName);
+    fprintf(stderr, "  %s commit\n", myName);
+    fprintf(stderr, "  %s status\n", myName);
+    fprintf(stderr, "  %s flush\n", myName);
+    fprintf(stderr, "  %s crc <EEPROM offset> <length>\n", myName);
+    fprintf(stderr, "  %s verify <EEPROM offset> <list of bytes separated by ,>\n", myName);
+    fprintf(stderr, "  %s bench\n", myName);
+    fprintf(stderr, "  %s caps\n", myName);
+    fprintf(stderr, "  %s monitor [ticks of 10ms between packets, 0 to stop] [event flags]\n", myName);
+    fprintf(stderr, "  %s wait [event flags, default end of sequence]\n", myName);
 }
 
 int main(int argc, char **argv)
 {
 usbDevice_t *dev;
-// for now, we are holding to the per-transfer data limit of 254 bytes
-char        buffer[254+1];    /* room for dummy report ID */
+// the per-transfer data limit is 254 bytes unless built with long transfers
+char        buffer[MAX_TRANSFER+1];    /* room for report ID */
+unsigned char status[STATUS_SIZE];
 int         err;
 
     if(argc < 2){
@@ -105,27 +333,28 @@ int         err;
     }
     if((dev = openDevice()) == NULL)
         exit(1);
+    readCaps(dev);
     if(strcasecmp(argv[1], "read") == 0){
         if (argc < 3) {
           usage(argv[0]);
           exit(1);
         }
 
-        int len=254;
+        int len=maxTransfer;
         if (sscanf(argv[2], "%d", &len) != 1) {
           fprintf(stderr, "error parsing numeric argument %s\n", argv[2]);
           exit(1);
         }
 
-        if (len>254) {
-          fprintf(stderr, "request number of bytes exceeds 254\n");
+        if (len>maxTransfer) {
+          fprintf(stderr, "request number of bytes exceeds %d\n", maxTransfer);
           exit(1);
         }
 
-        // remember we have to read in the dummy report ID
+        // remember we have to read in the report ID
         len +=1;
 
-        if((err = usbhidGetReport(dev, 0, buffer, &len)) != 0){
+        if((err = usbhidGetReport(dev, REPORT_DATA, buffer, &len)) != 0){
             fprintf(stderr, "error reading data: %s\n", usbErrorMessage(err));
         }else{
             hexdump(buffer + 1, len - 1);
@@ -133,28 +362,229 @@ int         err;
     }else if(strcasecmp(argv[1], "write") == 0){
         int i, pos;
         memset(buffer, 0, sizeof(buffer));
-        for(pos = 2, i = 2; i < argc && pos < sizeof(buffer); i++){
-            pos += hexread(buffer + pos, argv[i], sizeof(buffer) - pos);
+        buffer[0] = REPORT_DATA;
+        for(pos = 2, i = 2; i < argc && pos <= maxTransfer; i++){
+            pos += hexread(buffer + pos, argv[i], maxTransfer + 1 - pos);
         }
         hexdump(buffer, pos);
         buffer[1] = CMD_WRITE;
         if((err = usbhidSetReport(dev, buffer, pos)) != 0)
             fprintf(stderr, "error writing data: %s\n", usbErrorMessage(err));
         else printf("wrote out %u bytes, %u was user data\n", pos, pos-2);
+        if(err == 0 && (err = flush(dev, status)) == 0)
+            printf("%u bytes needed writing\n", STATUS_WORD(status, STATUS_WRITTEN));
+        // upload_seq.py only commits the bank if this succeeds
+        if(err != 0)
+            exit(1);
+    } else if (strcasecmp(argv[1], "readat") == 0) {
+      int offset, len;
+      if (argc < 4 ||
+          sscanf(argv[2], "%i", &offset) != 1 ||
+          sscanf(argv[3], "%i", &len) != 1 ||
+          len < 0 || len > maxTransfer) {
+        usage(argv[0]);
+        exit(1);
+      }
+
+      buffer[0] = REPORT_COMMAND;
+      buffer[1] = CMD_READ_AT;
+      buffer[2] = offset & 0xff;
+      buffer[3] = offset >> 8;
+      len += 1;
+      if((err = usbhidSetReport(dev, buffer, 4)) != 0 ||
+         (err = usbhidGetReport(dev, REPORT_DATA, buffer, &len)) != 0)
+          fprintf(stderr, "error reading data: %s\n", usbErrorMessage(err));
+      else hexdump(buffer + 1, len - 1);
+    } else if (strcasecmp(argv[1], "writeat") == 0) {
+      int offset, i, pos;
+      if (argc < 4 || sscanf(argv[2], "%i", &offset) != 1) {
+        usage(argv[0]);
+        exit(1);
+      }
+
+      memset(buffer, 0, sizeof(buffer));
+      buffer[0] = REPORT_DATA;
+      for(pos = 4, i = 3; i < argc && pos <= maxTransfer; i++){
+          pos += hexread(buffer + pos, argv[i], maxTransfer + 1 - pos);
+      }
+      buffer[1] = CMD_WRITE_AT;
+      buffer[2] = offset & 0xff;
+      buffer[3] = offset >> 8;
+      if((err = usbhidSetReport(dev, buffer, pos)) != 0)
+          fprintf(stderr, "error writing data: %s\n", usbErrorMessage(err));
+      else printf("wrote %u bytes at %d\n", pos - 4, offset);
+      if(err == 0 && flush(dev, status) == 0)
+          printf("%u bytes needed writing\n", STATUS_WORD(status, STATUS_WRITTEN));
     } else if (strcasecmp(argv[1], "restart") == 0) {
-      buffer[0] = 0;
+      buffer[0] = REPORT_COMMAND;
       buffer[1] = CMD_RESTART;
       int len = 2;
       if((err = usbhidSetReport(dev, buffer, len)) != 0)
           fprintf(stderr, "error writing data: %s\n", usbErrorMessage(err));
       else printf("sent RESTART command\n");
+    } else if (strcasecmp(argv[1], "pause") == 0 ||
+               strcasecmp(argv[1], "resume") == 0 ||
+               strcasecmp(argv[1], "step") == 0) {
+      buffer[0] = REPORT_COMMAND;
+      if (strcasecmp(argv[1], "pause") == 0) buffer[1] = CMD_PAUSE;
+      else if (strcasecmp(argv[1], "resume") == 0) buffer[1] = CMD_RESUME;
+      else buffer[1] = CMD_STEP;
+      if((err = usbhidSetReport(dev, buffer, 2)) != 0)
+          fprintf(stderr, "error writing data: %s\n", usbErrorMessage(err));
+      else printf("sent %s command\n", argv[1]);
+    } else if (strcasecmp(argv[1], "seek") == 0) {
+      buffer[0] = REPORT_COMMAND;
+      buffer[1] = CMD_SEEK;
+      int n;
+      if (argc > 2 && sscanf(argv[2], "%d", &n) == 1) {
+        buffer[2] = n&0xff;
+        buffer[3] = (n>>8)&0xff;
+        int len = 4;
+
+        if((err = usbhidSetReport(dev, buffer, len)) != 0)
+            fprintf(stderr, "error writing data: %s\n", usbErrorMessage(err));
+        else printf("sent SEEK command\n");
+      } else {
+        usage(argv[0]);
+        exit(1);
+      }
+    } else if (strcasecmp(argv[1], "overlay") == 0) {
+      int i, n, len = 2;
+      buffer[0] = REPORT_COMMAND;
+      buffer[1] = CMD_OVERLAY;
+      buffer[3] = ARG_DEFAULT;
+      buffer[4] = ARG_DEFAULT;
+      for (i = 2; i < argc && i < 5; i++) {
+        if (sscanf(argv[i], "%d", &n) != 1) {
+          usage(argv[0]);
+          exit(1);
+        }
+        buffer[len++] = n&0xff;
+      }
+      if (len == 2) {
+        usage(argv[0]);
+        exit(1);
+      }
+      if((err = usbhidSetReport(dev, buffer, 5)) != 0)
+          fprintf(stderr, "error writing data: %s\n", usbErrorMessage(err));
+      else printf("sent OVERLAY command\n");
+    } else if (strcasecmp(argv[1], "batch") == 0) {
+      int i, n, pos = 2;
+      if (argc < 3) {
+        usage(argv[0]);
+        exit(1);
+      }
+
+      // one command per argument, each preceded by its length
+      buffer[0] = REPORT_DATA;
+      buffer[1] = CMD_BATCH;
+      for (i = 2; i < argc; i++) {
+        n = hexread(buffer + pos + 1, argv[i], maxTransfer - pos);
+        if (n == 0 || n > BATCH_ENTRY_SIZE) {
+          fprintf(stderr, "command %d must be 1 to %d bytes\n", i - 1, BATCH_ENTRY_SIZE);
+          exit(1);
+        }
+        buffer[pos] = n;
+        pos += n + 1;
+      }
+      if((err = usbhidSetReport(dev, buffer, pos)) != 0 ||
+         (err = readStatus(dev, status)) != 0)
+          fprintf(stderr, "error writing data: %s\n", usbErrorMessage(err));
+      else printf("ran %d of %d commands%s\n", status[STATUS_BATCH] & ~STATUS_BATCH_FAILED,
+          argc - 2, status[STATUS_BATCH] & STATUS_BATCH_FAILED ? ", stopped at a refused command" : "");
+    } else if (strcasecmp(argv[1], "live") == 0) {
+      int r, g, b, fade, frames = 0;
+      char line[80];
+      double start = now(), t;
+
+      buffer[0] = REPORT_COMMAND;
+      buffer[1] = CMD_LIVE;
+      if (argc == 3 && strcmp(argv[2], "-") == 0) {
+        // send frames as fast as they come, and report the rate reached
+        while (fgets(line, sizeof(line), stdin) != NULL) {
+          fade = 0;
+          if (sscanf(line, "%i %i %i %i", &r, &g, &b, &fade) < 3)
+            continue;
+          buffer[2] = r;
+          buffer[3] = g;
+          buffer[4] = b;
+          buffer[5] = fade;
+          if((err = usbhidSetReport(dev, buffer, 6)) != 0) {
+            fprintf(stderr, "error writing data: %s\n", usbErrorMessage(err));
+            break;
+          }
+          frames++;
+        }
+        t = now() - start;
+        printf("sent %d frames in %.1f ms, %.0f frames/s\n", frames, t * 1000, frames / t);
+      } else if (argc > 4 &&
+          sscanf(argv[2], "%i", &r) == 1 &&
+          sscanf(argv[3], "%i", &g) == 1 &&
+          sscanf(argv[4], "%i", &b) == 1) {
+        buffer[2] = r;
+        buffer[3] = g;
+        buffer[4] = b;
+        buffer[5] = argc > 5 ? atoi(argv[5]) : 0;
+        if((err = usbhidSetReport(dev, buffer, 6)) != 0)
+            fprintf(stderr, "error writing data: %s\n", usbErrorMessage(err));
+        else printf("sent LIVE command\n");
+      } else {
+        usage(argv[0]);
+        exit(1);
+      }
+    } else if (strcasecmp(argv[1], "patch") == 0) {
+      int i, n;
+
+      buffer[0] = REPORT_COMMAND;
+      buffer[1] = CMD_PATCH;
+      for (i = 0; i < 5; i++) {
+        if (argc <= i + 2 || sscanf(argv[i + 2], "%i", &n) != 1) {
+          usage(argv[0]);
+          exit(1);
+        }
+        buffer[i + 2] = n;
+      }
+      if((err = usbhidSetReport(dev, buffer, 7)) != 0)
+          fprintf(stderr, "step was not patched: %s\n", usbErrorMessage(err));
+      else printf("sent PATCH command\n");
+    } else if (strcasecmp(argv[1], "persist") == 0) {
+      buffer[0] = REPORT_COMMAND;
+      buffer[1] = CMD_PERSIST;
+      if((err = usbhidSetReport(dev, buffer, 2)) != 0)
+          fprintf(stderr, "patch was not persisted: %s\n", usbErrorMessage(err));
+      else printf("sent PERSIST command\n");
+    } else if (strcasecmp(argv[1], "block") == 0) {
+      unsigned char *p = (unsigned char *)buffer + 1;
+      int len = PATCH_SIZE + 1;
+
+      if((err = usbhidGetReport(dev, REPORT_PATCH, buffer, &len)) != 0)
+          fprintf(stderr, "error reading block: %s\n", usbErrorMessage(err));
+      else if (len != PATCH_SIZE + 1)
+          fprintf(stderr, "error reading block: %s\n", usbErrorMessage(USBOPEN_ERR_IO));
+      else {
+        printf("block %u: rgb %02x%02x%02x duration %u%s%s\n",
+            STATUS_WORD(p, PATCH_NUMBER),
+            p[PATCH_RGB], p[PATCH_RGB + 1], p[PATCH_RGB + 2], p[PATCH_DURATION],
+            p[PATCH_FLAGS] & PATCH_PENDING ? ", patched" : "",
+            p[PATCH_FLAGS] & PATCH_EEPROM ? "" : ", in flash");
+      }
+    } else if (strcasecmp(argv[1], "commit") == 0) {
+      buffer[0] = REPORT_COMMAND;
+      buffer[1] = CMD_COMMIT;
+      if((err = usbhidSetReport(dev, buffer, 2)) != 0)
+          fprintf(stderr, "uploaded bank was rejected: %s\n", usbErrorMessage(err));
+      else printf("sent COMMIT command\n");
     } else if (strcasecmp(argv[1], "goto") == 0) {
-      buffer[0] = 0;
+      buffer[0] = REPORT_COMMAND;
       buffer[1] = CMD_GOTO;
-      int n;
+      int n, fade;
       if (sscanf(argv[2], "%d", &n) == 1) {
         buffer[2] = n&0xff;
-        int len = 3;
+        // sent even when it is left out, see ARG_DEFAULT
+        buffer[3] = ARG_DEFAULT;
+        int len = 4;
+        if (argc > 3 && sscanf(argv[3], "%d", &fade) == 1)
+          buffer[3] = fade < ARG_DEFAULT ? fade : ARG_DEFAULT - 1;
 
         if((err = usbhidSetReport(dev, buffer, len)) != 0)
             fprintf(stderr, "error writing data: %s\n", usbErrorMessage(err));
@@ -163,6 +593,244 @@ int         err;
         fprintf(stderr, "error parsing number argument: %s\n", argv[2]);
         exit(1);
       }
+    } else if (strcasecmp(argv[1], "gotoseq") == 0) {
+      buffer[0] = REPORT_COMMAND;
+      buffer[1] = CMD_GOTO_SEQ;
+      int n, fade;
+      if (argc > 2 && sscanf(argv[2], "%d", &n) == 1) {
+        buffer[2] = n&0xff;
+        // sent even when it is left out, see ARG_DEFAULT
+        buffer[3] = ARG_DEFAULT;
+        int len = 4;
+        if (argc > 3 && sscanf(argv[3], "%d", &fade) == 1)
+          buffer[3] = fade < ARG_DEFAULT ? fade : ARG_DEFAULT - 1;
+
+        if((err = usbhidSetReport(dev, buffer, len)) != 0)
+            fprintf(stderr, "error writing data: %s\n", usbErrorMessage(err));
+        else printf("sent GOTO_SEQ command\n");
+      } else {
+        usage(argv[0]);
+        exit(1);
+      }
+    } else if (strcasecmp(argv[1], "speed") == 0) {
+      buffer[0] = REPORT_COMMAND;
+      buffer[1] = CMD_SPEED;
+      double speed;
+      if (argc > 2 && sscanf(argv[2], "%lf", &speed) == 1 && speed >= 0 && speed < 255) {
+        int n = (int)(speed * SPEED_ONE + 0.5);
+        buffer[2] = n&0xff;
+        buffer[3] = n>>8;
+        int len = 4;
+
+        if((err = usbhidSetReport(dev, buffer, len)) != 0)
+            fprintf(stderr, "error writing data: %s\n", usbErrorMessage(err));
+        else printf("sent SPEED command\n");
+      } else {
+        usage(argv[0]);
+        exit(1);
+      }
+    } else if (strcasecmp(argv[1], "writeseq") == 0) {
+      int id, start, flags, i, pos;
+      if (argc < 6 ||
+          sscanf(argv[2], "%i", &id) != 1 ||
+          sscanf(argv[3], "%i", &start) != 1 ||
+          sscanf(argv[4], "%i", &flags) != 1) {
+        usage(argv[0]);
+        exit(1);
+      }
+
+      // the directory entry goes in front of the blocks
+      memset(buffer, 0, sizeof(buffer));
+      buffer[0] = REPORT_DATA;
+      for(pos = 7, i = 5; i < argc && pos <= maxTransfer; i++){
+          pos += hexread(buffer + pos, argv[i], maxTransfer + 1 - pos);
+      }
+      if ((pos - 7) % 4) {
+        fprintf(stderr, "sequence is not a whole number of blocks\n");
+        exit(1);
+      }
+      buffer[1] = CMD_WRITE_SEQ;
+      buffer[2] = id;
+      buffer[3] = start & 0xff;
+      buffer[4] = start >> 8;
+      buffer[5] = (pos - 7) / 4;
+      buffer[6] = flags;
+      if((err = usbhidSetReport(dev, buffer, pos)) != 0)
+          fprintf(stderr, "error writing data: %s\n", usbErrorMessage(err));
+      else printf("wrote sequence %d, %u blocks\n", id, (pos - 7) / 4);
+      if(err == 0 && flush(dev, status) == 0)
+          printf("%u bytes needed writing\n", STATUS_WORD(status, STATUS_WRITTEN));
+    } else if (strcasecmp(argv[1], "writeflash") == 0) {
+      char data[USERFLASH_SIZE];
+      int offset, i, pos, n;
+      if (argc < 4 || sscanf(argv[2], "%i", &offset) != 1) {
+        usage(argv[0]);
+        exit(1);
+      }
+
+      for(pos = 0, i = 3; i < argc && pos < sizeof(data); i++){
+          pos += hexread(data + pos, argv[i], sizeof(data) - pos);
+      }
+
+      // one transfer per flash page, giving the device time to program
+      // each page before sending the next
+      for (i = 0, err = 0; i < pos && err == 0; i += n) {
+        n = FLASH_PAGE_SIZE - (offset + i) % FLASH_PAGE_SIZE;
+        if (n > pos - i) n = pos - i;
+
+        buffer[0] = REPORT_DATA;
+        buffer[1] = CMD_WRITE_FLASH;
+        buffer[2] = (offset + i) & 0xff;
+        buffer[3] = (offset + i) >> 8;
+        memcpy(buffer + 4, data + i, n);
+        if((err = usbhidSetReport(dev, buffer, n + 4)) != 0)
+            fprintf(stderr, "error writing data: %s\n", usbErrorMessage(err));
+        usleep(FLASH_PAGE_WRITE_MS * 1000);
+      }
+      if (err == 0) printf("wrote %d bytes to flash\n", pos);
+    } else if (strcasecmp(argv[1], "status") == 0) {
+      if((err = readStatus(dev, status)) != 0)
+          fprintf(stderr, "error reading status: %s\n", usbErrorMessage(err));
+      else {
+        printf("EEPROM bytes written by last write: %u\n", STATUS_WORD(status, STATUS_WRITTEN));
+        printf("EEPROM bytes waiting to be written: %u\n", status[STATUS_PENDING]);
+        printf("playing bank: %u%s\n", status[STATUS_BANK] & ~STATUS_BANK_SWITCHING,
+            status[STATUS_BANK] & STATUS_BANK_SWITCHING ? ", switching" : "");
+        printf("commands run by last batch: %u%s\n", status[STATUS_BATCH] & ~STATUS_BATCH_FAILED,
+            status[STATUS_BATCH] & STATUS_BATCH_FAILED ? ", then refused one" : "");
+        if (status[STATUS_STACK] != 0xff)
+            printf("stack bytes never used: %u\n", status[STATUS_STACK]);
+      }
+    } else if (strcasecmp(argv[1], "flush") == 0) {
+      if((err = flush(dev, status)) != 0)
+          fprintf(stderr, "error reading status: %s\n", usbErrorMessage(err));
+      else printf("all data written\n");
+    } else if (strcasecmp(argv[1], "monitor") == 0) {
+      int period, events;
+      if (argc > 2) {
+        if (sscanf(argv[2], "%i", &period) != 1 || period < 0 || period > 0xffff) {
+          usage(argv[0]);
+          exit(1);
+        }
+        buffer[0] = REPORT_COMMAND;
+        buffer[1] = CMD_TELEMETRY;
+        buffer[2] = period & 0xff;
+        buffer[3] = period >> 8;
+        buffer[4] = ARG_DEFAULT;
+        if (argc > 3 && sscanf(argv[3], "%i", &events) == 1)
+          buffer[4] = events;
+        if((err = usbhidSetReport(dev, buffer, 5)) != 0) {
+          fprintf(stderr, "error writing data: %s\n", usbErrorMessage(err));
+          exit(1);
+        }
+        if (period == 0) exit(0);
+      }
+
+      // one line per packet until interrupted, or the device goes quiet
+      for (;;) {
+        unsigned char *t = (unsigned char *)buffer + 1;
+        int len = TELEMETRY_SIZE + 1;
+
+        if((err = usbhidReadInput(dev, buffer, &len, 60000)) != 0) {
+          fprintf(stderr, "error reading telemetry: %s\n", usbErrorMessage(err));
+          break;
+        }
+        if (len != TELEMETRY_SIZE + 1) continue;
+        printf("%5u: rgb %02x%02x%02x seq %u block %u%s%s%s%s%s%s%s%s\n",
+            STATUS_WORD(t, TELEMETRY_TICKS),
+            t[TELEMETRY_RGB], t[TELEMETRY_RGB + 1], t[TELEMETRY_RGB + 2],
+            t[TELEMETRY_SEQ], t[TELEMETRY_BLOCK],
+            t[TELEMETRY_FLAGS] & TELEMETRY_ERROR ? " error" : "",
+            t[TELEMETRY_FLAGS] & TELEMETRY_RUNAWAY ? " runaway" : "",
+            t[TELEMETRY_FLAGS] & TELEMETRY_PAUSED ? " paused" : "",
+            t[TELEMETRY_FLAGS] & TELEMETRY_OVERLAY ? " overlay" : "",
+            t[TELEMETRY_FLAGS] & TELEMETRY_SWITCHING ? " switching" : "",
+            t[TELEMETRY_FLAGS] & TELEMETRY_STEP ? " step" : "",
+            t[TELEMETRY_FLAGS] & TELEMETRY_LOOP ? " loop" : "",
+            t[TELEMETRY_FLAGS] & TELEMETRY_END ? " end" : "");
+        fflush(stdout);
+      }
+    } else if (strcasecmp(argv[1], "wait") == 0) {
+      int events = TELEMETRY_END;
+      if (argc > 2 && sscanf(argv[2], "%i", &events) != 1) {
+        usage(argv[0]);
+        exit(1);
+      }
+
+      // returns as soon as the device pushes one of the events, so that
+      // scripts can chain commands without polling
+      for (;;) {
+        int len = TELEMETRY_SIZE + 1;
+
+        if((err = usbhidReadInput(dev, buffer, &len, 60000)) != 0) {
+          fprintf(stderr, "error reading telemetry: %s\n", usbErrorMessage(err));
+          exit(1);
+        }
+        if (len == TELEMETRY_SIZE + 1 && (buffer[1 + TELEMETRY_FLAGS] & events))
+          break;
+      }
+    } else if (strcasecmp(argv[1], "crc") == 0) {
+      int offset, len;
+      unsigned crc;
+      if (argc < 4 ||
+          sscanf(argv[2], "%i", &offset) != 1 ||
+          sscanf(argv[3], "%i", &len) != 1) {
+        usage(argv[0]);
+        exit(1);
+      }
+      if((err = deviceCrc(dev, offset, len, &crc)) != 0)
+          fprintf(stderr, "error reading CRC: %s\n", usbErrorMessage(err));
+      else printf("0x%04x\n", crc);
+    } else if (strcasecmp(argv[1], "verify") == 0) {
+      int offset, i, pos;
+      unsigned crc;
+      if (argc < 4 || sscanf(argv[2], "%i", &offset) != 1) {
+        usage(argv[0]);
+        exit(1);
+      }
+
+      for(pos = 0, i = 3; i < argc && pos < sizeof(buffer); i++){
+          pos += hexread(buffer + pos, argv[i], sizeof(buffer) - pos);
+      }
+      if (!SUPPORTS(CMD_CRC)) {
+        char image[sizeof(buffer)];
+
+        // no CRC on the device, so read the data back instead
+        if((err = readImage(dev, image, offset, pos, maxTransfer)) != 0)
+            fprintf(stderr, "error reading data: %s\n", usbErrorMessage(err));
+        else if (memcmp(image, buffer, pos) != 0) {
+            printf("%d bytes at %d differ\n", pos, offset);
+            exit(2);
+        } else printf("%d bytes at %d match\n", pos, offset);
+      } else if((err = deviceCrc(dev, offset, pos, &crc)) != 0)
+          fprintf(stderr, "error reading CRC: %s\n", usbErrorMessage(err));
+      else if (crc != crc16(buffer, pos)) {
+          printf("%d bytes at %d differ: CRC 0x%04x, expected 0x%04x\n", pos, offset, crc, crc16(buffer, pos));
+          exit(2);
+      } else printf("%d bytes at %d match\n", pos, offset);
+    } else if (strcasecmp(argv[1], "bench") == 0) {
+      // the chunked path every build has, then the largest report this
+      // device allows
+      if((err = bench(dev, SHORT_TRANSFER)) != 0 ||
+         (maxTransfer > SHORT_TRANSFER && (err = bench(dev, maxTransfer)) != 0))
+          fprintf(stderr, "error benchmarking: %s\n", usbErrorMessage(err));
+    } else if (strcasecmp(argv[1], "caps") == 0) {
+      int cmd;
+
+      if (!haveCaps) {
+        fprintf(stderr, "device does not report its capabilities\n");
+        exit(1);
+      }
+      printf("firmware version: %u.%02u\n", caps[CAPS_VERSION + 1], caps[CAPS_VERSION]);
+      printf("EEPROM: %u bytes in %u banks\n", STATUS_WORD(caps, CAPS_EEPROM), caps[CAPS_BANKS]);
+      printf("commands:");
+      for (cmd = 0; cmd < 32; cmd++)
+        if (SUPPORTS(cmd)) printf(" %d", cmd);
+      printf("\n");
+      printf("opcodes: 0x%04x, setup options: 0x%02x, directory flags: 0x%02x\n",
+          STATUS_WORD(caps, CAPS_OPCODES), caps[CAPS_OPTIONS], caps[CAPS_SEQ_FLAGS]);
+      printf("largest data report: %u bytes\n", STATUS_WORD(caps, CAPS_TRANSFER));
+      printf("tick: %u ms\n", caps[CAPS_TICK]);
     }else{
         usage(argv[0]);
         exit(1);
@@ -2,11 +2,14 @@
 """
 Reads a file that contains 4 bytes each line, written in hex and comma seaprated.
 Using this file, composes a hidtool command line to write this to the faerii.
+The image is written to the bank which is not playing, so the command line
+commits it too, which makes it play from the next block on.
 
 Comments can be added using #, blank lines are ignored.
 """
 
 HIDCMD="./hidtool write"
+COMMITCMD="./hidtool commit"
 
 import sys
 
@@ -16,16 +19,15 @@ def main(args):
   hexbytes = []
   with open(inputf) as f:
     for line in f.readlines():
-      line = line.strip()
-      line = line.split('#',1)[0]
+      line = line.split('#',1)[0].strip()
       if len(line):
-        hexbytes += line.split(' ')
+        hexbytes += line.split()
 
     try:
       # validate the data
       for hb in hexbytes:
         int(hb,16)
-      print HIDCMD,','.join(hexbytes)
+      print HIDCMD,','.join(hexbytes),'&&',COMMITCMD
       return 0
     except Exception, ex:
       print "non-hex value encountered: ", hb
@@ -9,30 +9,276 @@
 // the tiny85 has 512 bytes of EEPROM
 #define EEPROM_SIZE         (512)
 
+// EEPROM is split into banks, each holding a complete image. One bank plays
+// while the next one is uploaded, see rgb.c. Set this to 1 to use all of
+// EEPROM for one image.
+#define EEPROM_BANKS        (2)
+#define BANK_SIZE           (EEPROM_SIZE/EEPROM_BANKS)
+
+// number of slots in the sequence directory, see rgb.c
+#define SEQ_DIR_ENTRIES     (8)
+
+// size of the stack of the sequence VM, see rgb.c, which all tracks share.
+// Each open loop or call takes one entry.
+#define VM_STACK_SIZE       (6)
+
+// sequences in the flash library are numbered from this ID onwards
+#define SEQLIB_FIRST_ID     (0x80)
+
+// bytes of flash reserved for user sequences, at the address given by
+// USERFLASH in the Makefile. Flash is written a page at a time, and each
+// page takes an erase and a write cycle of 4.5ms each, after up to two
+// ticks to let the status stage go out.
+#define USERFLASH_SIZE      (0x800)
+#define FLASH_PAGE_SIZE     (64)
+#define FLASH_PAGE_WRITE_MS (30)
+
+// EEPROM writes are queued, see eeStore.c. This must be a power of two,
+// and at least one USB packet.
+#define EE_QUEUE_SIZE       (8)
+
 // set this to zero if you are using a common
 // cathode RGB LED
 #define COMMON_ANODE_LED    (1)
 
 /*
- * When the hosts writes data to the device, the first data byte
- * is a command byte. This reduces the number of bytes we can
- * transfer at once to 253.
+ * Every report starts with its report ID:
+ *
+ *  - REPORT_COMMAND: COMMAND_SIZE bytes, a command and its data.
+ *  - REPORT_DATA: 128 bytes, or 1024 with LONG_TRANSFERS, for bulk data.
+ *  - REPORT_STATUS, REPORT_CRC, REPORT_PATCH, REPORT_CAPS: read only, laid
+ *    out as below.
+ *  - REPORT_TELEMETRY: pushed on the interrupt-in endpoint.
+ *
+ * Either of the first two may carry any command. The first byte after the
+ * report ID is the command, so a transfer carries at most 252 more. Bytes
+ * after those the command uses are ignored. An optional data byte which is
+ * left out, or is ARG_DEFAULT, takes its default, so a host which pads
+ * with zeros must send ARG_DEFAULT for those.
+ *
+ * A plain read of REPORT_DATA returns EEPROM from offset 0. READ_AT takes a
+ * 2 byte EEPROM offset, ignoring banks, and the next read starts there.
+ * WRITE_AT takes the same offset, then the bytes to write. Multi-byte
+ * values are low byte first throughout.
+ *
+ * WRITE writes to the bank after the one which is playing, and COMMIT
+ * switches to it at the next block boundary. WRITE is refused while a
+ * switch is pending. Only COMMIT writes the bank's magic, so an uncommitted
+ * bank never plays after a reset, when the newest committed bank plays.
+ *
+ * GOTO takes a block number, counted from the first block of track 0's
+ * sequence as for OP_JUMP. GOTO_SEQ takes a sequence ID, from
+ * SEQLIB_FIRST_ID on in the flash library. Either may be followed by a
+ * crossfade time in units of MS_PER_UNIT_DURATION; ARG_DEFAULT fades over
+ * the new step's own duration.
+ *
+ * WRITE_SEQ takes a sequence ID and its 4 byte directory entry (start,
+ * length in blocks, flags), then the blocks, written from the start. The
+ * entry is written last, so a cut off transfer leaves no sequence rather
+ * than a broken one. It is refused without a directory, while a commit is
+ * waiting, or if it would touch blocks which are playing.
+ *
+ * WRITE_FLASH takes an offset into the user flash region, then at most
+ * FLASH_PAGE_SIZE bytes within one page. The page is programmed from the
+ * main loop, and the host must wait FLASH_PAGE_WRITE_MS before the next.
+ *
+ * EEPROM writes are queued, and the device NAKs while the queue has no room
+ * for a packet. STATUS_PENDING says when the data is in EEPROM.
+ *
+ * SPEED takes 8.8 fixed point, SPEED_ONE being normal and 0 stopped, from
+ * the next tick until RESTART. PAUSE stops time, effects included, until
+ * RESUME. STEP starts the next step. SEEK takes a time in units of
+ * MS_PER_UNIT_DURATION from the start of the sequence, and is refused past
+ * SEEK_MAX_STEPS steps.
+ *
+ * LIVE shows red, green and blue at once, with an optional fade. The
+ * sequence holds until LIVE_TIMEOUT ticks after the last frame, then fades
+ * back in over LIVE_RESUME_FADE. GOTO, GOTO_SEQ, SEEK and RESTART end it.
+ *
+ * OVERLAY plays a sequence once over the one which is playing, with an
+ * optional blend mode and alpha, BLEND_ALPHA and 0xff by default. 0xff as
+ * the ID stops it.
+ *
+ * BATCH runs several commands from one report, each preceded by its
+ * length including the command byte, at most BATCH_ENTRY_SIZE. A length of
+ * 0 ends it. WRITE, WRITE_AT, WRITE_SEQ, WRITE_FLASH and BATCH cannot be
+ * batched, and COMMIT and PERSIST are refused while the EEPROM queue has no
+ * room for them. The batch stops at the first refused command, and
+ * STATUS_BATCH says how far it got.
+ *
+ * CRC takes an EEPROM offset and length, and works out the CRC-16/MODBUS
+ * of that range, queued writes included, for REPORT_CRC.
+ *
+ * PATCH takes a track, red, green, blue and duration, and replaces the step
+ * that track is playing in RAM only, until PERSIST writes it to EEPROM or
+ * another bank plays. One block is patched at a time. Held steps and
+ * opcodes cannot be patched, and PERSIST is refused for flash.
  *
- * There are 3 write/reads because EEPROM is 512 bytes, while we can only
- * transfer 254 bytes at a time. The additional read and write commands
- * have different start addresses. e.g. READ_CMD reads to 0 onwards, while
- * READ_2 reads from 254 and READ_3 reads from 508.
+ * The host reads REPORT_CAPS once, and picks commands and transfer size
+ * from it. If the read fails it should assume short transfers only.
  *
- * For now only READ, WRITE, RESTART, and GOTO is implemented.
+ * REPORT_TELEMETRY is pushed every TELEMETRY_PERIOD ticks, and as soon as
+ * the host can take it once an event in TELEMETRY_EVENTS is raised.
+ * TELEMETRY takes the period, 0 to stop, and optionally the event flags.
+ * Both are kept over RESTART.
  */
 
-///#define CMD_READD            (0)
-///#define CMD_READ2           (1)
-///#define CMD_READ3           (3)
+#define CMD_READ_AT         (1)
 #define CMD_WRITE           (4)
-///#define CMD_WRITE2          (5)
-///#define CMD_WRITE3          (6)
+#define CMD_WRITE_AT        (5)
 #define CMD_RESTART         (7)
 #define CMD_GOTO            (8)
+#define CMD_GOTO_SEQ        (9)
+#define CMD_WRITE_SEQ       (10)
+#define CMD_WRITE_FLASH     (11)
+#define CMD_COMMIT          (13)
+#define CMD_SPEED           (14)
+#define CMD_PAUSE           (15)
+#define CMD_RESUME          (16)
+#define CMD_STEP            (17)
+#define CMD_SEEK            (18)
+#define CMD_OVERLAY         (19)
+#define CMD_TELEMETRY       (20)
+#define CMD_LIVE            (21)
+#define CMD_BATCH           (22)
+#define CMD_CRC             (23)
+#define CMD_PATCH           (24)
+#define CMD_PERSIST         (25)
 #define CMD_NONE            (0xff)
+
+// an optional data byte with this value takes its default
+#define ARG_DEFAULT         (0xff)
+
+#define REPORT_COMMAND      (1)
+#define REPORT_DATA         (2)
+#define REPORT_STATUS       (3)
+#define REPORT_TELEMETRY    (4)
+#define REPORT_CRC          (5)
+#define REPORT_PATCH        (6)
+#define REPORT_CAPS         (7)
+
+// a command and its data, without the report ID
+#define COMMAND_SIZE        (8)
+
+// number of EEPROM bytes which had to be written by the last WRITE or
+// WRITE_SEQ, unchanged bytes are skipped
+#define STATUS_WRITTEN      (0)
+// number of queued EEPROM bytes which are not yet written. Once this is
+// zero, everything written so far is durable.
+#define STATUS_PENDING      (2)
+// the bank which is playing, with STATUS_BANK_SWITCHING set if a commit is
+// waiting for the next block boundary
+#define STATUS_BANK         (3)
+#define STATUS_BANK_SWITCHING (0x80)
+// the number of commands the last BATCH ran, with STATUS_BATCH_FAILED set
+// if it stopped at a command it could not run
+#define STATUS_BATCH        (4)
+#define STATUS_BATCH_FAILED (0x80)
+// bytes of RAM the stack has never reached since reset, at most 254
+#define STATUS_STACK        (5)
+#define STATUS_SIZE         (6)
+
+// the CRC so far, and the number of bytes still to go. The CRC is final
+// once that is zero.
+#define CRC_VALUE           (0)
+#define CRC_LEFT            (2)
+#define CRC_SIZE            (4)
+
+// CRC-16/MODBUS, as _crc16_update() in avr-libc
+#define CRC_INIT            (0xffff)
+
+// EEPROM bytes added to the CRC each time around the main loop
+#define CRC_BYTES_PER_POLL  (8)
+
+// the block, as stored, and its number as taken by GOTO, 2 bytes
+#define PATCH_RGB           (0)
+#define PATCH_DURATION      (3)
+#define PATCH_NUMBER        (4)
+#define PATCH_FLAGS         (6)
+#define PATCH_SIZE          (7)
+
+// the block differs from the stored one until PERSIST
+#define PATCH_PENDING       (1<<0)
+// the block is in EEPROM, so it can be persisted
+#define PATCH_EEPROM        (1<<1)
+
+// the firmware version, minor then major, as USB_CFG_DEVICE_VERSION
+#define CAPS_VERSION        (0)
+// EEPROM_SIZE, 2 bytes, and EEPROM_BANKS
+#define CAPS_EEPROM         (2)
+#define CAPS_BANKS          (4)
+// 4 bytes, bit n set if command n is supported
+#define CAPS_COMMANDS       (5)
+// block formats: 2 bytes, bit n set if opcode OP_FIRST+n is supported,
+// then the setup block options and the directory entry flags supported
+#define CAPS_OPCODES        (9)
+#define CAPS_OPTIONS        (11)
+#define CAPS_SEQ_FLAGS      (12)
+// the most bytes a REPORT_DATA transfer carries after its report ID, 2
+// bytes
+#define CAPS_TRANSFER       (13)
+// MS_PER_TICK
+#define CAPS_TICK           (15)
+#define CAPS_SIZE           (16)
+
+// the longest command a BATCH may hold, command byte included
+#define BATCH_ENTRY_SIZE    (8)
+
+// the colour being shown, red then green and blue
+#define TELEMETRY_RGB       (0)
+// the number of the block track 0 is on, as taken by GOTO
+#define TELEMETRY_BLOCK     (3)
+// the sequence which is playing
+#define TELEMETRY_SEQ       (4)
+// 10ms ticks since the device started, wrapping around
+#define TELEMETRY_TICKS     (5)
+// TELEMETRY_* flags below
+#define TELEMETRY_FLAGS     (7)
+#define TELEMETRY_SIZE      (8)
+
+// the player has stopped with an error, and shows red
+#define TELEMETRY_ERROR     (1<<0)
+// the VM ran out of opcodes it may run for a step, e.g. an empty loop, or
+// of stack for a loop, since the sequence was selected
+#define TELEMETRY_RUNAWAY   (1<<1)
+#define TELEMETRY_PAUSED    (1<<2)
+#define TELEMETRY_OVERLAY   (1<<3)
+// a commit is waiting for the next block boundary
+#define TELEMETRY_SWITCHING (1<<4)
+// events since the last packet: track 0 started a step, a loop ran its
+// last pass, and a sequence, or the overlay, reached its end or a
+// delimiter. The end of a called sequence is not an event.
+#define TELEMETRY_STEP      (1<<5)
+#define TELEMETRY_LOOP      (1<<6)
+#define TELEMETRY_END       (1<<7)
+
+// the player ticks over once every MS_PER_TICK, see rgb.c
+#define MS_PER_TICK         (10)
+
+// telemetry period after a reset, in ticks of 10ms
+#define TELEMETRY_PERIOD    (100)
+// flags which push a packet straight away after a reset. TELEMETRY_ERROR
+// and TELEMETRY_RUNAWAY do so when they are raised.
+#define TELEMETRY_EVENTS    (TELEMETRY_ERROR | TELEMETRY_RUNAWAY | \
+                             TELEMETRY_LOOP | TELEMETRY_END)
+
+// OVERLAY blend modes. The overlay is first scaled by alpha/255, then
+//  - BLEND_ALPHA: mixed with the base by alpha
+//  - BLEND_MAX: the brighter of the two is shown, per channel
+//  - BLEND_ADD: the two are added
+#define BLEND_ALPHA         (0)
+#define BLEND_MAX           (1)
+#define BLEND_ADD           (2)
+
+// LIVE frames are dropped after this many ticks of 10ms without one, and
+// the sequence fades back in over LIVE_RESUME_FADE units
+#define LIVE_TIMEOUT        (100)
+#define LIVE_RESUME_FADE    (25)
+
+// SEEK plays through at most this many steps of each track to find the
+// time
+#define SEEK_MAX_STEPS      (255)
+
+#define SPEED_ONE           (0x100)
+#define SPEED_MAX           (0xff00)
 #endif
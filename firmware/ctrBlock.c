@@ -1,77 +1,789 @@
-#include <avr/eeprom.h>
+#include <stddef.h>
+#include <avr/pgmspace.h>
 
 #include "config.h"
 #include "ctrBlock.h"
+#include "eeStore.h"
+#include "seqlib.h"
+#include "flashStore.h"
+#include "lfsr.h"
+#include "effect.h"
 
-uint16 _eepromAddr;
-ControlBlock _curBlock;
+// where blocks are read from
+#define SRC_EEPROM          (0)
+#define SRC_SEQLIB          (1)
+#define SRC_USERFLASH       (2)
 
-#define BLOCK_SIZE          (sizeof(_curBlock))
+uint8 _options;
 
-#define INC_EEPROM_ADDR()   (_eepromAddr += BLOCK_SIZE)
-#define DEC_EEPROM_ADDR()   (_eepromAddr -= BLOCK_SIZE)
+// EEPROM addresses are relative to the start of the playing bank
+#define NO_BANK             (0xff)
+#define BANK_BASE(bank)     ((bank) * BANK_SIZE)
+
+uint8 _bank;
+uint16 _bankBase;
+uint8 _pendingBank;
+
+#define BLOCK_SIZE          (sizeof(ControlBlock))
+
+// the setup block is followed by the jitter block if RGB_RANDOM_ON_READ is
+// set, then by the directory
+#define HEADER_SIZE(options) (((options) & RGB_RANDOM_ON_READ ? 2 : 1) * BLOCK_SIZE)
+#define DIR_ADDR(seqId)     (_header + (seqId)*sizeof(SeqDirEntry))
+#define DIR_END(header)     ((header) + SEQ_DIR_ENTRIES*sizeof(SeqDirEntry))
+
+uint16 _header;
+
+// per channel jitter ranges from the jitter block
+uint8 _bankJitter[3];
+
+// opcodes are run by a small VM, see rgb.c. Each frame of its stack is an
+// open loop or a call. The tracks share the stack, so each frame is tagged
+// with the track it belongs to.
+#define FRAME_LOOP          (0)
+#define FRAME_CALL          (1)
+#define FRAME_KIND(frame)   ((frame)->kind & 1)
+#define FRAME_TRACK(frame)  ((frame)->kind >> 1)
+#define NO_FRAME            (0xff)
+
+// bounds the work done for one step
+#define VM_MAX_OPS          (16)
+
+// OP_TIME scales
+#define TIME_SCALES         (3)
+
+typedef struct {
+  uint16 addr;  // of the LOOP or CALL block
+  uint8 kind;   // FRAME_LOOP or FRAME_CALL, and the track
+  uint8 arg;    // passes left, or the ID of the calling sequence
+} VmFrame;
+
+// the frames of a track are in order, but may be mixed with those of others
+VmFrame _stack[VM_STACK_SIZE];
+uint8 _sp;
+
+// loops of each track which did not fit on the stack and play once. They
+// are always its innermost, so the next OP_ENDLOOPs close them.
+uint8 _lost[TRACKS + 1];
+
+// where a track is up to. The sequence spans [start, end) in source.
+typedef struct {
+  ControlBlock block;
+  uint16 addr;
+
+  uint8 source;
+  uint16 start;
+  uint16 end;
+  uint8 flags;
+  uint8 id;
+
+  // duration of the current step, and that given by OP_TIME for the next
+  uint16 stepDuration;
+  uint8 stepScale;
+  uint16 time;
+  uint8 timeScale;
+  uint8 timed;
+
+  // colour of the last step, for OP_HOLD, and whether block repeats it
+  uint8 held[3];
+  uint8 holding;
+
+  // jitter ranges in use, which OP_JITTER may change
+  uint8 jitter[3];
+} Cursor;
+
+// one track per channel for split sequences, otherwise just the first,
+// then the overlay
+Cursor _cursors[TRACKS + 1];
+uint8 _tracks;
+uint8 _overlay;
+
+// the cursor being worked on, and its track
+Cursor *_c;
+uint8 _track;
+
+// set when the VM gives up on a step, or on a loop which does not fit on
+// the stack, until another sequence is selected
+uint8 _runaway;
+
+// a block changed in RAM only. It replaces the stored block wherever that
+// is read, until it is persisted or another bank is played.
+uint8 _patched;
+uint8 _patchSource;
+uint16 _patchAddr;
+uint16 _patchStart;
+ControlBlock _patch;
+
+// TELEMETRY_STEP, TELEMETRY_LOOP and TELEMETRY_END since they were cleared
+uint8 _events;
+
+// set by ctrBlockSeek() while SEEK plays through, with the events from
+// before it started
+uint8 _seeking;
+uint8 _seekEvents;
+
+// _c->holding once a SEQ_ONCE sequence has ended
+#define HOLD_END            (2)
+// _c->holding while execute() waits to run the opcode at _c->addr
+#define HOLD_RESUME         (3)
+
+#define INC_BLOCK_ADDR()    (_c->addr += BLOCK_SIZE)
+#define DEC_BLOCK_ADDR()    (_c->addr -= BLOCK_SIZE)
+
+void selectCursor(uint8 track) {
+  _track = track;
+  _c = &_cursors[track];
+}
+
+/**
+ * Returns the index in _stack of the top frame of track, or NO_FRAME if it
+ * has none
+ */
+uint8 topFrame(uint8 track) {
+  uint8 i = _sp;
+
+  while (i-- > 0)
+    if (FRAME_TRACK(&_stack[i]) == track) return i;
+  return NO_FRAME;
+}
+
+/**
+ * Pushes a frame for the block at _c->addr, unless the stack is full
+ */
+void pushFrame(uint8 kind, uint8 arg) {
+  if (_sp == VM_STACK_SIZE) return;
+
+  _stack[_sp].addr = _c->addr;
+  _stack[_sp].kind = kind | _track << 1;
+  _stack[_sp].arg = arg;
+  _sp++;
+}
+
+void dropFrame(uint8 i) {
+  for (_sp--; i < _sp; i++) _stack[i] = _stack[i + 1];
+}
+
+void dropFrames(uint8 track) {
+  uint8 i;
+
+  while ((i = topFrame(track)) != NO_FRAME) dropFrame(i);
+  _lost[track] = 0;
+}
 
 void readCtrBlock() {
-  eeprom_read_block(&_curBlock, (const void*)_eepromAddr, BLOCK_SIZE);
+  if (_c->source == SRC_SEQLIB)
+    memcpy_P(&_c->block, seqLibBlocks + _c->addr, BLOCK_SIZE);
+  else if (_c->source == SRC_USERFLASH)
+    memcpy_P(&_c->block, userFlash + _c->addr, BLOCK_SIZE);
+  else
+    eeStoreRead((uint8*)&_c->block, _bankBase + _c->addr, BLOCK_SIZE);
+
+  if (_patched && _c->source == _patchSource && _c->addr == _patchAddr)
+    _c->block = _patch;
 }
 
 /**
- * Rewinds _eepromAddr to the first block after setup block, or the
+ * Makes seqId the current sequence, without reading any blocks. Returns
+ * zero, leaving the current sequence alone, if there is no such sequence.
+ */
+uint8 loadSequence(uint8 seqId) {
+  SeqDirEntry entry;
+  uint8 source = SRC_EEPROM;
+
+  if (seqId >= SEQLIB_FIRST_ID) {
+    // the library is generated, so its entries need no checking
+    if (seqId - SEQLIB_FIRST_ID >= pgm_read_byte(&seqLibEntries)) return 0;
+
+    memcpy_P(&entry, &seqLibDir[seqId - SEQLIB_FIRST_ID], sizeof(entry));
+    source = SRC_SEQLIB;
+  } else if (_options & RGB_DIRECTORY) {
+    if (seqId >= SEQ_DIR_ENTRIES) return 0;
+
+    eeStoreRead((uint8*)&entry, _bankBase + DIR_ADDR(seqId), sizeof(entry));
+    if (!ctrBlockValidSequence(seqId, &entry)) return 0;
+    if (entry.flags & SEQ_USERFLASH) source = SRC_USERFLASH;
+  } else if (seqId == 0) {
+    // without a directory everything after the header
+    // is one big sequence
+    entry.start = _header;
+    entry.length = (BANK_SIZE - _header) / BLOCK_SIZE;
+    entry.flags = 0;
+  } else return 0;
+
+  _c->source = source;
+  _c->start = entry.start;
+  _c->end = entry.start + entry.length * BLOCK_SIZE;
+  _c->flags = entry.flags;
+  _c->id = seqId;
+  return 1;
+}
+
+/**
+ * Rewinds _c->addr to the first block of the current sequence, or the
  * the first block after next lowest delimiter block.
  *
- * After calling this function, _curBlock contains valid control
- * values, and _eepromAddr points to a valid block.
+ * After calling this function, _c->block contains the block at
+ * _c->addr, which may be an opcode.
  * */
 void rewind() {
-  while (_eepromAddr>0) {
-    DEC_EEPROM_ADDR();
+  while (_c->addr > _c->start) {
+    DEC_BLOCK_ADDR();
     readCtrBlock();
-    if (_curBlock.duration == 0xff) break;
+    if (_c->block.duration == OP_DELIMITER) {
+      INC_BLOCK_ADDR();
+      break;
+    }
   }
 
-  INC_EEPROM_ADDR();
   readCtrBlock();
 }
 
-ControlBlock *ctrBlockCurrent() { return &_curBlock;}
+/**
+ * Turns _c->block into a step which holds the colour of the last block
+ * played for duration.
+ */
+void hold(uint8 duration) {
+  _c->block.r = _c->held[0];
+  _c->block.g = _c->held[1];
+  _c->block.b = _c->held[2];
+  _c->block.duration = duration < OP_FIRST ? duration : OP_FIRST - 1;
+  _c->holding = 1;
+}
 
-ControlBlock *ctrBlockSetup() {
-  _eepromAddr = 0;
-  readCtrBlock();
+/**
+ * Called when the end of the current sequence, or a delimiter, is
+ * reached. If the sequence was called, sets _c->addr to the block after
+ * the call and returns non-zero, and the caller moves there. Otherwise the
+ * sequence repeats or holds.
+ */
+uint8 endOfSequence() {
+  uint8 i;
+
+  // calls are refused while a lost loop is open, so it is in this sequence
+  _lost[_track] = 0;
+  while ((i = topFrame(_track)) != NO_FRAME) {
+    VmFrame frame = _stack[i];
+
+    // loops left open by the called sequence are dropped with it
+    dropFrame(i);
+    if (FRAME_KIND(&frame) == FRAME_CALL) {
+      loadSequence(frame.arg);
+      _c->addr = frame.addr + BLOCK_SIZE;
+      return 1;
+    }
+  }
+
+  _events |= TELEMETRY_END;
+  if (_c == &_cursors[OVERLAY]) {
+    // the overlay always plays once, and ends rather than holding
+    _overlay = 0;
+    hold(0);
+  } else if (_c->flags & SEQ_ONCE) {
+    // stay on the last block, and hold its colour. ctrBlockNext() renews
+    // the hold from then on.
+    _c->addr = _c->end - BLOCK_SIZE;
+    hold(OP_FIRST - 1);
+    _c->holding = HOLD_END;
+  } else rewind();
+  return 0;
+}
+
+/**
+ * Moves to the block at addr, and reads it into _c->block. Runs off the
+ * end of the sequence, and delimiters, are handled here, so _c->block is
+ * either a step or an opcode afterwards.
+ */
+void moveTo(uint16 addr) {
+  _c->holding = 0;
+  _c->addr = addr;
+
+  // a call may end where its caller does, so this loops over each return
+  // rather than recursing, which would cost stack for every open call
+  do {
+    if (_c->addr >= _c->start && _c->addr < _c->end) {
+      readCtrBlock();
+      if (_c->block.duration != OP_DELIMITER) return;
+    }
+  } while (endOfSequence());
+}
+
+/**
+ * Runs opcodes, starting with the one in _c->block, until _c->block holds
+ * a step which can be played.
+ */
+ControlBlock *execute() {
+  VmFrame *frame;
+  uint8 ops, top, id;
+
+  for (ops = 0; _c->block.duration >= OP_FIRST; ops++) {
+    if (ops == VM_MAX_OPS) {
+      // e.g. an empty loop, or a sequence of nothing but opcodes. Hold
+      // for a moment, and carry on with this opcode next time around.
+      hold(1);
+      _c->holding = HOLD_RESUME;
+      _runaway = 1;
+      break;
+    }
+
+    switch (_c->block.duration) {
+      case OP_LOOP:
+        // once a loop is lost, so are the loops inside it, however the
+        // stack frees up
+        if (_sp < VM_STACK_SIZE && !_lost[_track])
+          pushFrame(FRAME_LOOP, _c->block.r);
+        else {
+          _lost[_track]++;
+          _runaway = 1;
+        }
+        break;
+
+      case OP_ENDLOOP:
+        if (_lost[_track]) {
+          _lost[_track]--;
+          break;
+        }
+
+        top = topFrame(_track);
+        if (top == NO_FRAME) break;
+
+        frame = &_stack[top];
+        if (FRAME_KIND(frame) == FRAME_LOOP) {
+          if (frame->arg == 0 || --frame->arg) {
+            moveTo(frame->addr + BLOCK_SIZE);
+            continue;
+          } else {
+            dropFrame(top);
+            _events |= TELEMETRY_LOOP;
+          }
+        }
+        break;
+
+      case OP_JUMP:
+        moveTo(_c->start + (_c->block.r | (uint16)_c->block.g << 8) * BLOCK_SIZE);
+        continue;
+
+      case OP_CALL:
+        id = _c->id;
+        if (_sp < VM_STACK_SIZE && !_lost[_track] && loadSequence(_c->block.r)) {
+          pushFrame(FRAME_CALL, id);
+          moveTo(_c->start);
+          continue;
+        }
+        break;
+
+      case OP_RET:
+        if (endOfSequence()) moveTo(_c->addr);
+        continue;
+
+      case OP_HOLD:
+        hold(_c->block.r);
+        continue;
+
+      case OP_TIME:
+        _c->time = _c->block.r | (uint16)_c->block.g << 8;
+        _c->timeScale = _c->block.b < TIME_SCALES ? _c->block.b : TIME_SCALES - 1;
+        _c->timed = 1;
+        break;
+
+      case OP_EFFECT:
+        // effects belong to the base layer
+        if (_c != &_cursors[OVERLAY])
+          effectSet(_c->block.r, _c->block.g, _c->block.b);
+        break;
+
+      case OP_JITTER:
+        _c->jitter[0] = _c->block.r;
+        _c->jitter[1] = _c->block.g;
+        _c->jitter[2] = _c->block.b;
+        break;
+    }
+
+    // unknown opcodes are skipped, so that they can be added later
+    moveTo(_c->addr + BLOCK_SIZE);
+  }
+
+  // only the copy in RAM is randomised, so a held colour is not
+  // randomised twice and stored blocks are never rewritten
+  if (!_c->holding) {
+    _c->block.r = lfsrJitter(_c->block.r, _c->jitter[0]);
+    _c->block.g = lfsrJitter(_c->block.g, _c->jitter[1]);
+    _c->block.b = lfsrJitter(_c->block.b, _c->jitter[2]);
+  }
+
+  _c->held[0] = _c->block.r;
+  _c->held[1] = _c->block.g;
+  _c->held[2] = _c->block.b;
+
+  // a pending OP_TIME is kept for the step after a runaway hold
+  if (_c->timed && _c->holding != HOLD_RESUME) {
+    _c->stepDuration = _c->time;
+    _c->stepScale = _c->timeScale;
+    _c->timed = 0;
+  } else {
+    _c->stepDuration = _c->block.duration;
+    _c->stepScale = 0;
+  }
+  return &_c->block;
+}
+
+/**
+ * Starts the cursor at the beginning of its sequence, and returns its
+ * first step
+ */
+ControlBlock *startCursor() {
+  dropFrames(_track);
+  _c->timed = 0;
+  _c->jitter[0] = _bankJitter[0];
+  _c->jitter[1] = _bankJitter[1];
+  _c->jitter[2] = _bankJitter[2];
+  moveTo(_c->start);
+  return execute();
+}
+
+ControlBlock *ctrBlockCurrent(uint8 track) { return &_cursors[track].block;}
+
+uint16 ctrBlockDuration(uint8 track) { return _cursors[track].stepDuration; }
+
+// x1, x16, x256
+uint16 ctrBlockPrescale(uint8 track) { return 1 << (_cursors[track].stepScale * 4); }
+
+uint8 ctrBlockTracks() { return _tracks; }
+
+/**
+ * Returns non-zero if entry lies within its source, and after first if
+ * it is in EEPROM
+ */
+uint8 validEntry(SeqDirEntry *entry, uint16 first) {
+  uint16 end = BANK_SIZE;
+
+  if (entry->flags & SEQ_USERFLASH) {
+    first = 0;
+    end = USERFLASH_SIZE;
+  }
+
+  // erased slots read back as 0xffff and fail the bounds check
+  return entry->length &&
+         entry->start >= first &&
+         entry->start < end &&
+         entry->start % BLOCK_SIZE == 0 &&
+         entry->start + entry->length * BLOCK_SIZE <= end;
+}
+
+// imageOptions() of a block which is not a setup block
+#define NO_IMAGE            (0xff)
+
+// set once COMMIT has written the first byte of the magic
+#define COMMITTED(setup)    ((setup).r == SETUP_MAGIC0)
+
+/**
+ * Returns the options of the image which setup is the setup block of, or
+ * NO_IMAGE. Options of SETUP_V1 images are ignored, as they always were.
+ * The first byte of the magic is left to COMMITTED().
+ */
+uint8 imageOptions(ControlBlock *setup) {
+  if (setup->g != SETUP_MAGIC1) return NO_IMAGE;
+  if (setup->b == SETUP_V1) return 0;
+  if (setup->b == SETUP_V2) return setup->options & RGB_OPTIONS;
+  return NO_IMAGE;
+}
+
+/**
+ * Reads the setup block of bank into setup, and returns non-zero if bank
+ * holds an image and, if it has a directory, a playable first sequence.
+ * Whether it has been committed is up to the caller.
+ */
+uint8 validBank(uint8 bank, ControlBlock *setup) {
+  SeqDirEntry entry;
+  uint16 header;
+  uint8 options;
+
+  eeStoreRead((uint8*)setup, BANK_BASE(bank), BLOCK_SIZE);
 
   // check to see if the EEPROM has been initalised
-  if (  _curBlock.r   != 0xfa ||
-        _curBlock.g != 0xe2 ||
-        _curBlock.b  != 0x11 ) return NULL;
-  else {
-    // read the next block which actually contains
-    // control information
-    ctrBlockNext();
+  options = imageOptions(setup);
+  if (options == NO_IMAGE) return 0;
+  if (!(options & RGB_DIRECTORY)) return 1;
+
+  header = HEADER_SIZE(options);
+  eeStoreRead((uint8*)&entry, BANK_BASE(bank) + header, sizeof(entry));
+  return validEntry(&entry, DIR_END(header));
+}
+
+/**
+ * Starts playing from bank, which must be valid. Sequence seqId is played
+ * if the bank has it, otherwise the first sequence.
+ */
+ControlBlock *useBank(uint8 bank, uint8 seqId) {
+  ControlBlock header;
 
-    // $todo parse options here
-    return &_curBlock;
+  _bank = bank;
+  _bankBase = BANK_BASE(bank);
+  ctrBlockStopOverlay();
+  _patched = 0;
+  eeStoreRead((uint8*)&header, _bankBase, BLOCK_SIZE);
+
+  _options = imageOptions(&header);
+  _header = HEADER_SIZE(_options);
+
+  if (_options & RGB_RANDOM_ON_READ) {
+    eeStoreRead((uint8*)&header, _bankBase + BLOCK_SIZE, BLOCK_SIZE);
+    _bankJitter[0] = header.r;
+    _bankJitter[1] = header.g;
+    _bankJitter[2] = header.b;
+    lfsrSeed(header.options);
+  } else {
+    _bankJitter[0] = 0;
+    _bankJitter[1] = 0;
+    _bankJitter[2] = 0;
   }
+
+  if (ctrBlockGotoSequence(seqId)) return ctrBlockCurrent(0);
+  else return ctrBlockGotoSequence(0);
 }
 
-ControlBlock *ctrBlockNext() {
-  // $todo implement reversal here
-  INC_EEPROM_ADDR();
+ControlBlock *ctrBlockSetup() {
+  ControlBlock setup;
+  uint8 bank, newest = NO_BANK, generation = 0;
 
-  if (_eepromAddr > EEPROM_SIZE-BLOCK_SIZE) rewind();
-  else {
-    readCtrBlock();
-    if (_curBlock.duration == 0xff) rewind();
+  _pendingBank = NO_BANK;
+  ctrBlockStopOverlay();
+  _patched = 0;
+
+  // every commit counts on from the bank which was playing, so the newest
+  // bank is one generation on from the other. Otherwise the lowest wins.
+  for (bank = 0; bank < EEPROM_BANKS; bank++) {
+    if (!validBank(bank, &setup) || !COMMITTED(setup)) continue;
+    if (newest == NO_BANK ||
+        ((GENERATION(setup.options) - generation) & 3) == 1) {
+      newest = bank;
+      generation = GENERATION(setup.options);
+    }
+  }
+  if (newest != NO_BANK) return useBank(newest, 0);
+
+  // EEPROM has not been initialised, fall back to the library. Uploads
+  // go to the bank after bank 0.
+  _bank = 0;
+  _bankBase = 0;
+  _options = 0;
+  _header = BLOCK_SIZE;
+  return ctrBlockGotoSequence(SEQLIB_FIRST_ID);
+}
+
+ControlBlock *ctrBlockNext(uint8 track) {
+  if (track == 0 && _pendingBank != NO_BANK && !_seeking) {
+    uint8 bank = _pendingBank;
+    _pendingBank = NO_BANK;
+    return useBank(bank, ctrBlockSequence());
   }
 
-  return &_curBlock;
+  if (track == OVERLAY && !_overlay) return NULL;
+  selectCursor(track);
+
+  // $todo implement reversal here
+  if (_c->holding == HOLD_RESUME) moveTo(_c->addr);
+  else if (_c->holding != HOLD_END) moveTo(_c->addr + BLOCK_SIZE);
+  execute();
+
+  if (track == 0) _events |= TELEMETRY_STEP;
+
+  if (track == OVERLAY && !_overlay) return NULL;
+  return &_c->block;
+}
+
+uint8 ctrBlockNumber() {
+  return (_cursors[0].addr - _cursors[0].start) / BLOCK_SIZE;
 }
 
 ControlBlock *ctrBlockGoto(uint8 blockNumber) {
-  uint16 newaddr = blockNumber * BLOCK_SIZE;
-  if (newaddr == 0 || newaddr > EEPROM_SIZE-BLOCK_SIZE) return NULL;
+  uint16 newaddr;
+
+  selectCursor(0);
+  newaddr = _c->start + blockNumber * BLOCK_SIZE;
+  if (newaddr >= _c->end) return NULL;
   else {
-    _eepromAddr = newaddr;
-    readCtrBlock();
-    return &_curBlock;
+    dropFrames(0);
+    _c->timed = 0;
+    moveTo(newaddr);
+    return execute();
+  }
+}
+
+ControlBlock *ctrBlockGotoSequence(uint8 seqId) {
+  uint8 track;
+
+  selectCursor(0);
+  if (!loadSequence(seqId)) return NULL;
+
+  // the green and blue tracks of a split sequence are the next two
+  // sequences. If either is missing, the sequence is played as usual.
+  _tracks = 1;
+  if (_c->flags & SEQ_SPLIT) {
+    for (track = 1; track < TRACKS; track++) {
+      selectCursor(track);
+      if (!loadSequence(seqId + track)) break;
+    }
+    if (track == TRACKS) _tracks = TRACKS;
+  }
+
+  // tracks which no longer play must not keep their frames
+  for (track = _tracks; track < TRACKS; track++) dropFrames(track);
+
+  effectSet(EFFECT_NONE, 0, 0);
+  _runaway = 0;
+  for (track = _tracks; track-- > 0; ) {
+    selectCursor(track);
+    startCursor();
   }
+  return &_c->block;
+}
+
+uint8 ctrBlockValidSequence(uint8 seqId, SeqDirEntry *entry) {
+  // legacy images, and the library, have no directory to write to
+  return (_options & RGB_DIRECTORY) && seqId < SEQ_DIR_ENTRIES &&
+         validEntry(entry, DIR_END(_header));
+}
+
+uint8 ctrBlockBeginSequence(uint8 seqId, SeqDirEntry *entry) {
+  uint16 start = entry->start, end = start + entry->length * BLOCK_SIZE;
+  uint8 track, i, empty = 0;
+  Cursor *c;
+
+  if (!ctrBlockValidSequence(seqId, entry) || ctrBlockSwitching()) return 0;
+
+  // the bank is playing, so neither the sequence nor the blocks which are
+  // being played may change under a track
+  for (track = 0; track <= OVERLAY; track++) {
+    if (track == OVERLAY ? !_overlay : track >= _tracks) continue;
+    c = &_cursors[track];
+
+    if (c->id == seqId) return 0;
+    if (c->source == SRC_EEPROM && !(entry->flags & SEQ_USERFLASH) &&
+        start < c->end && c->start < end) return 0;
+  }
+
+  // only tracks which play have frames
+  for (i = 0; i < _sp; i++)
+    if (FRAME_KIND(&_stack[i]) == FRAME_CALL && _stack[i].arg == seqId) return 0;
+
+  eeStoreWrite(_bankBase + DIR_ADDR(seqId) + offsetof(SeqDirEntry, length),
+               &empty, 1);
+  return 1;
+}
+
+uint8 ctrBlockSetSequence(uint8 seqId, SeqDirEntry *entry) {
+  if (!ctrBlockValidSequence(seqId, entry)) return 0;
+
+  eeStoreWrite(_bankBase + DIR_ADDR(seqId), (const uint8*)entry, sizeof(*entry));
+  return 1;
+}
+
+ControlBlock *ctrBlockOverlay(uint8 seqId) {
+  selectCursor(OVERLAY);
+  if (!loadSequence(seqId)) return NULL;
+
+  _overlay = 1;
+  startCursor();
+  return _overlay ? &_c->block : NULL;
+}
+
+void ctrBlockStopOverlay() {
+  _overlay = 0;
+  dropFrames(OVERLAY);
+}
+
+uint8 ctrBlockOverlayActive() { return _overlay; }
+
+uint8 ctrBlockRunaway() { return _runaway; }
+
+ControlBlock *ctrBlockPatch(uint8 track, ControlBlock *cb) {
+  if (track >= _tracks || cb->duration >= OP_FIRST) return NULL;
+  selectCursor(track);
+
+  // a held step is not the block it was read from
+  if (_c->holding) return NULL;
+
+  // the step keeps the duration it started with, the new one counts the
+  // next time the block is played
+  _c->block = *cb;
+  _c->held[0] = cb->r;
+  _c->held[1] = cb->g;
+  _c->held[2] = cb->b;
+
+  _patched = 1;
+  _patchSource = _c->source;
+  _patchAddr = _c->addr;
+  _patchStart = _c->start;
+  _patch = *cb;
+  return &_c->block;
+}
+
+uint8 ctrBlockPersist() {
+  if (!_patched) return 1;
+  if (_patchSource != SRC_EEPROM) return 0;
+
+  eeStoreWrite(_bankBase + _patchAddr, (const uint8*)&_patch, BLOCK_SIZE);
+  _patched = 0;
+  return 1;
+}
+
+void ctrBlockPatchReport(uint8 *report) {
+  ControlBlock *cb = _patched ? &_patch : &_cursors[0].block;
+  uint16 addr = _patched ? _patchAddr : _cursors[0].addr;
+  uint16 start = _patched ? _patchStart : _cursors[0].start;
+  uint8 source = _patched ? _patchSource : _cursors[0].source;
+
+  report[PATCH_RGB] = cb->r;
+  report[PATCH_RGB + 1] = cb->g;
+  report[PATCH_RGB + 2] = cb->b;
+  report[PATCH_DURATION] = cb->duration;
+  report[PATCH_NUMBER] = ((addr - start) / BLOCK_SIZE) & 0xff;
+  report[PATCH_NUMBER + 1] = ((addr - start) / BLOCK_SIZE) >> 8;
+  report[PATCH_FLAGS] = (_patched ? PATCH_PENDING : 0) |
+                        (source == SRC_EEPROM ? PATCH_EEPROM : 0);
+}
+
+uint8 ctrBlockEvents() { return _events; }
+
+void ctrBlockClearEvents() { _events = 0; }
+
+void ctrBlockSeek(uint8 seeking) {
+  // events raised while seeking are dropped
+  if (seeking) {
+    _seekEvents = _events;
+    _events = 0;
+  } else _events = _seekEvents;
+  _seeking = seeking;
+}
+
+uint8 ctrBlockEnded(uint8 track) { return _cursors[track].holding == HOLD_END; }
+
+uint8 ctrBlockSequence() { return _cursors[0].id; }
+
+uint8 ctrBlockBank() { return _bank; }
+
+uint8 ctrBlockSwitching() { return _pendingBank != NO_BANK; }
+
+uint8 ctrBlockCommit() {
+  uint8 bank = (_bank + 1) % EEPROM_BANKS;
+  ControlBlock setup, playing;
+  uint8 generation = 0;
+
+  if (!validBank(bank, &setup)) return 0;
+
+  // the library fallback plays no committed bank, and bank 0 may hold
+  // anything, so the first commit starts from generation 0
+  if (validBank(_bank, &playing) && COMMITTED(playing))
+    generation = playing.options + (1 << 6);
+
+  // the generation goes in before the magic which makes the bank valid, so
+  // a reset part way through plays one bank or the other, never a mix
+  setup.options = (setup.options & ~SETUP_GENERATION) |
+                  (generation & SETUP_GENERATION);
+  setup.r = SETUP_MAGIC0;
+  eeStoreWrite(BANK_BASE(bank) + 3, &setup.options, 1);
+  eeStoreWrite(BANK_BASE(bank), &setup.r, 1);
+
+  _pendingBank = bank;
+  return 1;
 }
@@ -2,12 +2,184 @@
 
 #ifndef _CTRBLOCK_H
 #define _CTRBLOCK_H
+
+// the setup block starts with the magic, then the format version. Images
+// of SETUP_V1 were written before the options were read, and are played
+// without any. The first byte of the magic is only written by COMMIT.
+#define SETUP_MAGIC0        (0xfa)
+#define SETUP_MAGIC1        (0xe2)
+#define SETUP_V1            (0x11)
+#define SETUP_V2            (0x12)
+
+// the top bits of the options byte count commits, so that the newest bank
+// can be told after a reset. COMMIT sets them, whatever was uploaded.
+#define SETUP_GENERATION    (3<<6)
+#define GENERATION(options) ((options) >> 6)
+
+// options, stored in the 4th byte of the setup block
+#define RGB_REVERSE         (1<<0)
+#define RGB_RANDOM_ON_READ  (1<<1)
+#define RGB_DIRECTORY       (1<<2)
+#define RGB_OPTIONS         (RGB_REVERSE | RGB_RANDOM_ON_READ | RGB_DIRECTORY)
+
+// sequence directory entry flags
+#define SEQ_ONCE            (1<<0)
+#define SEQ_USERFLASH       (1<<1)
+#define SEQ_SPLIT           (1<<2)
+#define SEQ_FLAGS           (SEQ_ONCE | SEQ_USERFLASH | SEQ_SPLIT)
+
+// tracks of a split sequence, one per channel, and the overlay, which
+// plays on top of them
+#define TRACKS              (3)
+#define OVERLAY             (TRACKS)
+
+// durations from OP_FIRST up are opcodes, see rgb.c
+#define OP_FIRST            (0xf0)
+#define OP_TIME             (0xf5)
+#define OP_EFFECT           (0xf6)
+#define OP_JITTER           (0xf7)
+#define OP_LOOP             (0xf8)
+#define OP_ENDLOOP          (0xf9)
+#define OP_JUMP             (0xfa)
+#define OP_CALL             (0xfb)
+#define OP_RET              (0xfc)
+#define OP_HOLD             (0xfd)
+#define OP_DELIMITER        (0xff)
+
+// every opcode above, bit n for opcode OP_FIRST+n
+#define OP_BIT(op)          (1U << ((op) - OP_FIRST))
+#define OPCODES             (OP_BIT(OP_TIME) | OP_BIT(OP_EFFECT) | \
+                             OP_BIT(OP_JITTER) | OP_BIT(OP_LOOP) | \
+                             OP_BIT(OP_ENDLOOP) | OP_BIT(OP_JUMP) | \
+                             OP_BIT(OP_CALL) | OP_BIT(OP_RET) | \
+                             OP_BIT(OP_HOLD) | OP_BIT(OP_DELIMITER))
+
+/**
+ * Start playing after a restart, and return the first step of track 0
+ */
 ControlBlock *ctrBlockSetup();
-ControlBlock *ctrBlockCurrent();
-ControlBlock *ctrBlockNext();
 /**
- * Return the content of the block at blockNumber, or NULL
- * if blockNumber is zero or beyond the end of the array
+ * Return the number of tracks playing. This is TRACKS for a split
+ * sequence, where track n drives channel n, and otherwise 1, where track
+ * 0 drives all channels.
+ */
+uint8 ctrBlockTracks();
+ControlBlock *ctrBlockCurrent(uint8 track);
+/**
+ * Run opcodes up to the next step of track, and return it. The returned
+ * block always has a duration below OP_FIRST.
+ *
+ * For OVERLAY, NULL is returned once the overlay has ended.
+ *
+ * A commit takes effect when track 0 moves on. Every track then starts
+ * over, so the caller should restart all of them if ctrBlockSwitching()
+ * was set before the call.
+ */
+ControlBlock *ctrBlockNext(uint8 track);
+/**
+ * Return the duration of the current step of track, in units which are
+ * ctrBlockPrescale() times MS_PER_UNIT_DURATION long. This is the
+ * duration byte of the step unless it follows OP_TIME.
+ */
+uint16 ctrBlockDuration(uint8 track);
+uint16 ctrBlockPrescale(uint8 track);
+/**
+ * Return the number of the block track 0 is on, counted from the first
+ * block of its sequence, as taken by ctrBlockGoto()
+ */
+uint8 ctrBlockNumber();
+/**
+ * Move track 0 to blockNumber of its sequence, and return its step from
+ * there, or NULL if blockNumber is past the end of the sequence
  */
 ControlBlock *ctrBlockGoto(uint8 blockNumber);
+/**
+ * Make sequence seqId current and return the first step of track 0, or NULL
+ * if there is no directory or the directory slot is not valid.
+ * Without a directory, sequence 0 is everything after the setup (and jitter) block
+ */
+ControlBlock *ctrBlockGotoSequence(uint8 seqId);
+/**
+ * Play seqId once on the overlay track, and return its first step, or NULL
+ * if there is no such sequence
+ */
+ControlBlock *ctrBlockOverlay(uint8 seqId);
+void ctrBlockStopOverlay();
+/**
+ * Non-zero while the overlay is playing
+ */
+uint8 ctrBlockOverlayActive();
+/**
+ * Non-zero if the VM has given up on a step since the sequence was
+ * selected, see VM_MAX_OPS
+ */
+uint8 ctrBlockRunaway();
+/**
+ * Replace the current step of track with cb, in RAM only, and return it,
+ * or NULL if the step cannot be patched. The step keeps its duration, the
+ * patched one counts from the next time it is played. The stored block is
+ * replaced by cb wherever it is read until ctrBlockPersist(), or until
+ * another bank is played. Only one block is patched at a time.
+ */
+ControlBlock *ctrBlockPatch(uint8 track, ControlBlock *cb);
+/**
+ * Write the patched block back to EEPROM. Returns zero, keeping the patch,
+ * if the block is not in EEPROM.
+ */
+uint8 ctrBlockPersist();
+/**
+ * Fill report with the PATCH_SIZE byte REPORT_PATCH, see config.h
+ */
+void ctrBlockPatchReport(uint8 *report);
+/**
+ * Return the TELEMETRY_STEP, TELEMETRY_LOOP and TELEMETRY_END events since
+ * ctrBlockClearEvents() was last called
+ */
+uint8 ctrBlockEvents();
+void ctrBlockClearEvents();
+/**
+ * Called with 1 before SEEK plays tracks through with ctrBlockNext(), and
+ * with 0 afterwards. A commit does not take effect while seeking, and the
+ * events raised are dropped once it is over.
+ */
+void ctrBlockSeek(uint8 seeking);
+/**
+ * Non-zero once track has played a SEQ_ONCE sequence to its end, and holds
+ * its last colour
+ */
+uint8 ctrBlockEnded(uint8 track);
+/**
+ * Return the ID of the sequence which is playing
+ */
+uint8 ctrBlockSequence();
+/**
+ * Return non-zero if entry can be stored in directory slot seqId of the
+ * playing bank, which must have a directory
+ */
+uint8 ctrBlockValidSequence(uint8 seqId, SeqDirEntry *entry);
+/**
+ * Start replacing sequence seqId with entry, by emptying its slot, so that
+ * nothing plays the sequence while its blocks are written. Returns zero if
+ * the entry is not valid, the sequence or the blocks of entry are playing,
+ * or a commit is waiting.
+ */
+uint8 ctrBlockBeginSequence(uint8 seqId, SeqDirEntry *entry);
+/**
+ * Write entry into directory slot seqId. Returns zero if the entry
+ * is not valid, in which case the directory is left alone
+ */
+uint8 ctrBlockSetSequence(uint8 seqId, SeqDirEntry *entry);
+/**
+ * Return the bank which is playing. Uploads go to the next bank.
+ */
+uint8 ctrBlockBank();
+/**
+ * Return non-zero while a commit is waiting for the next block boundary
+ */
+uint8 ctrBlockSwitching();
+/**
+ * Check the upload bank, mark it as the newest, and switch to it at the
+ * next block boundary. Returns zero if the upload bank is not valid.
+ */
+uint8 ctrBlockCommit();
 #endif
@@ -0,0 +1,227 @@
+/* Queued EEPROM writes which only cost what changed.
+ *
+ * Writing a byte takes milliseconds, so writes are staged in a ring buffer
+ * and drained from the EEPROM ready interrupt. The entry being written stays
+ * in the ring until its write has finished, so an empty ring means the data
+ * is durable.
+ *
+ * An erase-and-write cycle takes 3.4ms, while an erase-only or a write-only
+ * cycle takes 1.8ms. Erasing sets all bits, and writing can only clear bits,
+ * so a byte which becomes 0xff only needs an erase, and a byte which only
+ * loses bits only needs a write.
+ *
+ * EEPROM cannot be read while a write is in progress. Code which must not
+ * wait for one, such as the player and the CRC, uses eeStoreHold(). When
+ * that finds a write going on, the interrupt parks the queue once the write
+ * is done, and eeStorePoll() only restarts it after a whole pass of the main
+ * loop, in which every such reader gets its turn.
+ */
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <util/crc16.h>
+
+#include "config.h"
+#include "eeStore.h"
+
+// EEPROM programming modes, see EECR
+#define EE_MODE_ATOMIC      (0)
+#define EE_MODE_ERASE       (_BV(EEPM0))
+#define EE_MODE_WRITE       (_BV(EEPM1))
+
+#define QUEUE_MASK          (EE_QUEUE_SIZE-1)
+
+// _qHead is only advanced by eeStoreWrite(), and _qTail only by the
+// interrupt. Both run freely and are masked on use.
+uint16 _qAddr[EE_QUEUE_SIZE];
+uint8 _qData[EE_QUEUE_SIZE];
+volatile uint8 _qHead;
+volatile uint8 _qTail;
+volatile uint8 _eeWriting;
+
+volatile uint16 _eeCount;
+
+// eeStoreHold() and eeStoreSuspend() calls not yet matched by
+// eeStoreResume(). The queue only drains while this is zero.
+uint8 _eeHolds;
+
+// set by eeStoreHold() when a write was in progress. The interrupt then
+// parks the queue for the next PARK_PASSES calls to eeStorePoll().
+#define PARK_PASSES         (2)
+volatile uint8 _eeWanted;
+volatile uint8 _eeParked;
+
+// start draining the queue, unless something is holding it
+#define RESTART()           do {if (!_eeHolds && !_eeParked && eeStorePending()) \
+                                  EECR |= _BV(EERIE);} while (0)
+
+ISR(EE_RDY_vect) {
+  uint8 i, old, value, mode;
+  uint16 addr;
+
+  // this clears EERIE, so we can let the USB interrupt in
+  EECR = 0;
+  sei();
+
+  // the write we started last time has finished
+  if (_eeWriting) {
+    _eeWriting = 0;
+    _qTail += 1;
+
+    // let a reader in before the next write
+    if (_eeWanted) {
+      _eeWanted = 0;
+      _eeParked = PARK_PASSES;
+      return;
+    }
+  }
+
+  while (_qHead != _qTail) {
+    i = _qTail & QUEUE_MASK;
+    addr = _qAddr[i];
+    value = _qData[i];
+
+    EEAR = addr;
+    EECR |= _BV(EERE);
+    old = EEDR;
+
+    if (old != value) {
+      if (value == 0xff) mode = EE_MODE_ERASE;
+      else if ((old & value) == value) mode = EE_MODE_WRITE;
+      else mode = EE_MODE_ATOMIC;
+
+      EECR = mode;
+      EEDR = value;
+      _eeWriting = 1;
+      _eeCount += 1;
+
+      // EEPE must be set within 4 cycles of EEMPE, and we want to be
+      // back here when it is done
+      cli();
+      EECR |= _BV(EEMPE);
+      EECR |= _BV(EEPE);
+      EECR |= _BV(EERIE);
+      return;
+    }
+
+    _qTail += 1;
+  }
+}
+
+uint8 eeStorePending() { return _qHead - _qTail; }
+
+uint8 eeStoreFree() { return EE_QUEUE_SIZE - eeStorePending(); }
+
+void eeStoreWrite(uint16 addr, const uint8 *data, uint8 len) {
+  uint8 i;
+
+  while (len--) {
+    // the interrupt will make room, even if it has just parked the queue
+    // for a reader, as eeStorePoll() cannot run until we return
+    while (eeStoreFree() == 0) {
+      _eeParked = 0;
+      RESTART();
+    }
+
+    i = _qHead & QUEUE_MASK;
+    _qAddr[i] = addr++;
+    _qData[i] = *data++;
+    _qHead += 1;
+
+    RESTART();
+  }
+}
+
+uint8 eeStoreHold() {
+  EECR &= ~_BV(EERIE);
+  if (EECR & _BV(EEPE)) {
+    _eeWanted = 1;
+    RESTART();
+    return 0;
+  }
+
+  _eeHolds += 1;
+  return 1;
+}
+
+void eeStoreSuspend() {
+  EECR &= ~_BV(EERIE);
+  eeprom_busy_wait();
+  _eeHolds += 1;
+}
+
+void eeStoreResume() {
+  _eeHolds -= 1;
+  RESTART();
+}
+
+void eeStoreRead(uint8 *data, uint16 addr, uint8 len) {
+  uint8 t;
+  uint16 offset;
+
+  // the interrupt must not move EEAR while we are reading. This only waits
+  // if the caller has not held the queue.
+  eeStoreSuspend();
+  eeprom_read_block(data, (const void*)addr, len);
+
+  // queued bytes replace what is in EEPROM, oldest first
+  for (t = _qTail; t != _qHead; t++) {
+    offset = _qAddr[t & QUEUE_MASK] - addr;
+    if (offset < len) data[offset] = _qData[t & QUEUE_MASK];
+  }
+
+  eeStoreResume();
+}
+
+uint16 eeStoreCount() {
+  uint16 n;
+  uint8 sreg = SREG;
+
+  cli();
+  n = _eeCount;
+  SREG = sreg;
+  return n;
+}
+
+void eeStoreResetCount() {
+  uint8 sreg = SREG;
+
+  cli();
+  _eeCount = 0;
+  SREG = sreg;
+}
+
+// the range eeStoreCrcBegin() was given, as far as it has got
+uint16 _crcAddr;
+uint16 _crcLeft;
+uint16 _crc;
+
+void eeStoreCrcBegin(uint16 addr, uint16 len) {
+  if (addr > EEPROM_SIZE) addr = EEPROM_SIZE;
+  if (len > EEPROM_SIZE - addr) len = EEPROM_SIZE - addr;
+
+  _crcAddr = addr;
+  _crcLeft = len;
+  _crc = CRC_INIT;
+}
+
+void eeStorePoll() {
+  uint8 data[CRC_BYTES_PER_POLL];
+  uint8 i, n;
+
+  if (_eeParked && --_eeParked == 0) RESTART();
+
+  if (_crcLeft == 0 || !eeStoreHold()) return;
+
+  n = _crcLeft < CRC_BYTES_PER_POLL ? _crcLeft : CRC_BYTES_PER_POLL;
+  eeStoreRead(data, _crcAddr, n);
+  eeStoreResume();
+  for (i = 0; i < n; i++) _crc = _crc16_update(_crc, data[i]);
+
+  _crcAddr += n;
+  _crcLeft -= n;
+}
+
+uint16 eeStoreCrc() { return _crc; }
+
+uint16 eeStoreCrcLeft() { return _crcLeft; }
@@ -0,0 +1,69 @@
+#include "types.h"
+
+#ifndef _EESTORE_H
+#define _EESTORE_H
+/**
+ * Queue len bytes from data to be written to EEPROM at addr, and return
+ * straight away. The writes are done from the EEPROM ready interrupt.
+ * Bytes which already hold the right value are skipped, and the rest use
+ * an erase-only or write-only cycle when the old and new bit patterns
+ * allow it.
+ *
+ * If the queue is full, this waits for room, unparking the queue if need
+ * be. Callers which must not block should check eeStoreFree() first, and
+ * it must not be called with a full queue while the queue is held.
+ */
+void eeStoreWrite(uint16 addr, const uint8 *data, uint8 len);
+/**
+ * Read len bytes at addr into data, as they will be once all queued
+ * writes are done. Unless the queue is held, this waits for the write in
+ * progress, which takes up to 3.4ms.
+ */
+void eeStoreRead(uint8 *data, uint16 addr, uint8 len);
+/**
+ * Number of free slots in the queue
+ */
+uint8 eeStoreFree();
+/**
+ * Number of bytes which are not yet in EEPROM, including the one being
+ * written. Once this is zero, everything written is durable.
+ */
+uint8 eeStorePending();
+/**
+ * Stop draining the queue without waiting, and return non-zero, if no
+ * write is in progress. EEPROM can then be read at once until
+ * eeStoreResume(). Otherwise return zero, and the queue makes way for the
+ * caller after the write in progress, so it should try again on the next
+ * pass of the main loop.
+ */
+uint8 eeStoreHold();
+/**
+ * Stop draining the queue, waiting for the write in progress, and restart
+ * it. While suspended no EEPROM write is in progress, which SPM requires.
+ * Holds and suspends nest, and each is ended by one eeStoreResume().
+ */
+void eeStoreSuspend();
+void eeStoreResume();
+/**
+ * Number of bytes actually written since eeStoreResetCount()
+ */
+uint16 eeStoreCount();
+void eeStoreResetCount();
+/**
+ * Start working out the CRC-16 of len bytes of EEPROM at addr, as
+ * eeStoreRead() sees them. The range is cut short at the end of EEPROM.
+ * The CRC is worked out CRC_BYTES_PER_POLL bytes at a time by
+ * eeStorePoll(), so USB is never held up.
+ */
+void eeStoreCrcBegin(uint16 addr, uint16 len);
+/**
+ * Called once per pass of the main loop, to restart a parked queue and to
+ * carry on with the CRC
+ */
+void eeStorePoll();
+/**
+ * The CRC so far, which is final once eeStoreCrcLeft() is zero
+ */
+uint16 eeStoreCrc();
+uint16 eeStoreCrcLeft();
+#endif
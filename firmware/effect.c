@@ -0,0 +1,127 @@
+/* Effects which are computed, rather than stored as control blocks.
+ *
+ * An effect modulates the colour which the control blocks produce, once per
+ * tick. The phase is 16 bits, and wraps once per period; only its high byte
+ * is used to look up the waveform.
+ */
+#include <avr/pgmspace.h>
+
+#include "effect.h"
+#include "lfsr.h"
+
+uint8 _effect;
+uint8 _effectPeriod;
+uint8 _effectDepth;
+uint16 _phase;
+uint16 _phaseStep;
+uint8 _level = UINT8_MAX;
+uint8 _noise;
+
+// first quarter of a sine wave, from 0 to 127
+PROGMEM const uint8 _sine[64] = {
+    0,   3,   6,   9,  12,  16,  19,  22,  25,  28,  31,  34,  37,  40,  43,  46,
+   49,  51,  54,  57,  60,  63,  65,  68,  71,  73,  76,  78,  81,  83,  85,  88,
+   90,  92,  94,  96,  98, 100, 102, 104, 106, 107, 109, 111, 112, 113, 115, 116,
+  117, 118, 120, 121, 122, 122, 123, 124, 125, 125, 126, 126, 126, 127, 127, 127,
+};
+
+/**
+ * Returns a sine wave for phase 0 to 255, offset to lie between 0 and 254
+ */
+uint8 sine(uint8 phase) {
+  uint8 i = phase & 0x3f;
+  uint8 s;
+
+  if (phase & 0x40) i = 0x3f - i;
+  s = pgm_read_byte(&_sine[i]);
+
+  if (phase & 0x80) return 127 - s;
+  else return 127 + s;
+}
+
+uint8 scale(uint8 value, uint8 level) {
+  return ((uint16)value * (level + 1)) >> 8;
+}
+
+void effectSet(uint8 type, uint8 period, uint8 depth) {
+  if (type == _effect && period == _effectPeriod && depth == _effectDepth) return;
+
+  _effect = type;
+  _effectPeriod = period;
+  _effectDepth = depth;
+  _phase = 0;
+  _level = UINT8_MAX;
+
+  if (period == 0) period = 1;
+  _phaseStep = UINT16_MAX / (period * TICKS_PER_EFFECT_PERIOD);
+}
+
+void effectTick(uint16 speed) {
+  uint16 last = _phase;
+  uint8 target;
+
+  if (_effect == EFFECT_NONE) return;
+
+  _phase += ((uint32)_phaseStep * speed) >> 8;
+
+  switch (_effect) {
+    case EFFECT_BREATHE:
+      _level = UINT8_MAX - scale(UINT8_MAX - sine(_phase >> 8), _effectDepth);
+      break;
+
+    case EFFECT_CANDLE:
+      // pick a new flicker level every period, and drift towards it
+      if (_phase < last) _noise = scale(lfsrNext(), _effectDepth);
+      target = UINT8_MAX - _noise;
+      if (_level > target) _level -= (_level - target + 3) / 4;
+      else _level += (target - _level + 3) / 4;
+      break;
+
+    case EFFECT_STROBE:
+      _level = (_phase >> 8) < _effectDepth ? UINT8_MAX : 0;
+      break;
+  }
+}
+
+void effectApply(uint8 *rgb) {
+  uint8 hue, rise, fall, brightness;
+  uint8 phase = _phase >> 8;
+
+  if (_effect == EFFECT_NONE) return;
+
+  if (_effect == EFFECT_RAINBOW) {
+    // go around depth/256 of the colour wheel from red, at the brightness
+    // of the brightest channel. Part of the wheel is walked there and back,
+    // so that there is no jump.
+    brightness = rgb[0];
+    if (rgb[1] > brightness) brightness = rgb[1];
+    if (rgb[2] > brightness) brightness = rgb[2];
+
+    if (_effectDepth != UINT8_MAX) {
+      if (phase & 0x80) phase = ~phase;
+      phase <<= 1;
+    }
+    hue = scale(phase, _effectDepth);
+    rise = (hue % 85) * 3;
+    fall = UINT8_MAX - rise;
+
+    if (hue < 85) {
+      rgb[0] = scale(fall, brightness);
+      rgb[1] = scale(rise, brightness);
+      rgb[2] = 0;
+    } else if (hue < 170) {
+      rgb[0] = 0;
+      rgb[1] = scale(fall, brightness);
+      rgb[2] = scale(rise, brightness);
+    } else {
+      rgb[0] = scale(rise, brightness);
+      rgb[1] = 0;
+      rgb[2] = scale(fall, brightness);
+    }
+    return;
+  }
+
+  rgb[0] = scale(rgb[0], _level);
+  rgb[1] = scale(rgb[1], _level);
+  rgb[2] = scale(rgb[2], _level);
+}
@@ -0,0 +1,29 @@
+#include "types.h"
+
+#ifndef _EFFECT_H
+#define _EFFECT_H
+
+// effect types, see rgb.c
+#define EFFECT_NONE         (0)
+#define EFFECT_BREATHE      (1)
+#define EFFECT_RAINBOW      (2)
+#define EFFECT_CANDLE       (3)
+#define EFFECT_STROBE       (4)
+
+// period is given in units of this many ticks of rgb.c, i.e. 100ms
+#define TICKS_PER_EFFECT_PERIOD (10)
+
+/**
+ * Select an effect. Selecting the effect which is already running does not
+ * restart it, so that sequences can set their effect each time around.
+ */
+void effectSet(uint8 type, uint8 period, uint8 depth);
+/**
+ * Advance the effect by one tick, at speed in 8.8 fixed point
+ */
+void effectTick(uint16 speed);
+/**
+ * Apply the effect to a colour, in place
+ */
+void effectApply(uint8 *rgb);
+#endif
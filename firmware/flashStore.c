@@ -0,0 +1,165 @@
+/* User sequences in self-programmed flash.
+ *
+ * The host writes at most one flash page per transfer. The data goes into
+ * the page buffer of the SPM unit, and the bytes around it which the host
+ * does not send are copied in from the flash page, so the page needs no
+ * copy in RAM. The tiny85 keeps the page buffer over the erase.
+ *
+ * SPM must not run while an EEPROM write is in progress, and an EEPROM
+ * write loses the page buffer, so none of this is done from the USB
+ * callbacks. Each packet is staged in _staged, and requests are held off
+ * until flashStorePoll() has filled it in from the main loop. That holds
+ * the EEPROM queue, with eeStoreHold(), from the first packet until the
+ * page has been written or the transfer is abandoned.
+ *
+ * The tiny85 has no read-while-write section, so the CPU, including the
+ * USB interrupt, is halted for the erase and the write. The control
+ * transfer's status stage goes out within a frame, so we leave it
+ * FLASH_STATUS_TICKS first, and requests are held off until the page is
+ * written.
+ *
+ * The SELFPRGEN fuse must be programmed, see the Makefile.
+ */
+#include <avr/io.h>
+#include <avr/boot.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+#include "config.h"
+#include "eeStore.h"
+#include "flashStore.h"
+#include "rgb.h"
+
+// placed by the linker, see USERFLASH in the Makefile
+const uint8 userFlash[USERFLASH_SIZE] __attribute__((section(".userflash"), used));
+
+#define PAGE_EMPTY          (0)
+#define PAGE_FILLING        (1)
+#define PAGE_READY          (2)
+
+// one USB packet
+#define STAGE_SIZE          (8)
+
+// at least one whole tick
+#define FLASH_STATUS_TICKS  (2)
+
+// the page buffer is filled a word at a time, so the low byte of a word
+// waits in _pageLow while _pageOffset is odd. _pageStart is where the
+// host's data starts, and _pageEnd where it ends so far.
+uint16 _pageAddr;
+uint8 _pageStart;
+uint8 _pageEnd;
+uint8 _pageOffset;
+uint8 _pageLow;
+uint8 _pageState;
+uint8 _pageEnded;
+uint8 _pageHeld;
+uint16 _pageTick;
+
+uint8 _staged[STAGE_SIZE];
+uint8 _stagedLen;
+
+void fillByte(uint8 value) {
+  uint8 sreg;
+
+  if (_pageOffset & 1) {
+    // the page buffer is only written by SPM right after SPMCSR
+    sreg = SREG;
+    cli();
+    boot_page_fill((uint16)userFlash + _pageAddr + _pageOffset - 1,
+                   _pageLow | (value << 8));
+    SREG = sreg;
+  } else _pageLow = value;
+  _pageOffset++;
+}
+
+/**
+ * Fills the page buffer with the bytes of the flash page up to end
+ */
+void fillFromFlash(uint8 end) {
+  while (_pageOffset < end)
+    fillByte(pgm_read_byte(userFlash + _pageAddr + _pageOffset));
+}
+
+void flashStoreCancel() {
+  if (_pageState != PAGE_FILLING) return;
+
+  if (_pageHeld) {
+    SPMCSR = _BV(CTPB);
+    eeStoreResume();
+    _pageHeld = 0;
+  }
+  _stagedLen = 0;
+  _pageState = PAGE_EMPTY;
+}
+
+uint8 flashStoreBegin(uint16 offset) {
+  flashStoreCancel();
+  if (_pageState == PAGE_READY || offset >= USERFLASH_SIZE) return 0;
+
+  _pageAddr = offset & ~(SPM_PAGESIZE-1);
+  _pageStart = offset & (SPM_PAGESIZE-1);
+  _pageEnd = _pageStart;
+  _pageOffset = 0;
+  _pageEnded = 0;
+  _pageState = PAGE_FILLING;
+  return 1;
+}
+
+uint8 flashStoreWrite(uint8 *data, uint8 len) {
+  uint8 i;
+
+  if (_pageState != PAGE_FILLING) return 0;
+  if (len > SPM_PAGESIZE - _pageEnd) len = SPM_PAGESIZE - _pageEnd;
+  if (len > STAGE_SIZE - _stagedLen) len = STAGE_SIZE - _stagedLen;
+
+  for (i = 0; i < len; i++) _staged[_stagedLen++] = data[i];
+  _pageEnd += len;
+  return len;
+}
+
+void flashStoreEnd() {
+  if (_pageState == PAGE_FILLING) _pageEnded = 1;
+}
+
+uint8 flashStoreBusy() { return _stagedLen || _pageState == PAGE_READY; }
+
+void flashStorePoll() {
+  uint16 addr = (uint16)userFlash + _pageAddr;
+  uint8 i, sreg;
+
+  if (_pageState == PAGE_EMPTY) return;
+
+  // rather than wait for an EEPROM write, try again next time around
+  if (!_pageHeld) {
+    if (!eeStoreHold()) return;
+    _pageHeld = 1;
+    fillFromFlash(_pageStart);
+  }
+
+  if (_pageState == PAGE_FILLING) {
+    for (i = 0; i < _stagedLen; i++) fillByte(_staged[i]);
+    _stagedLen = 0;
+
+    if (_pageEnded) {
+      fillFromFlash(SPM_PAGESIZE);
+      _pageState = PAGE_READY;
+      _pageTick = rgbTicks();
+    }
+    return;
+  }
+
+  if ((uint16)(rgbTicks() - _pageTick) < FLASH_STATUS_TICKS) return;
+
+  sreg = SREG;
+  cli();
+  boot_page_erase(addr);
+  boot_spm_busy_wait();
+  boot_page_write(addr);
+  boot_spm_busy_wait();
+  SREG = sreg;
+
+  eeStoreResume();
+  _pageHeld = 0;
+  _pageState = PAGE_EMPTY;
+}
@@ -0,0 +1,44 @@
+#include "types.h"
+
+#ifndef _FLASHSTORE_H
+#define _FLASHSTORE_H
+/**
+ * The user flash region, USERFLASH_SIZE bytes placed at the end of flash
+ * by the linker. Read it with the pgm_read/memcpy_P functions.
+ */
+extern const uint8 userFlash[];
+
+/**
+ * Start writing at offset into the user flash region. Data written
+ * afterwards must not cross into the next flash page. Returns zero if
+ * offset is out of range, or the previous page has not been programmed
+ * yet. EEPROM writes wait from the first flashStorePoll() until the page
+ * is programmed, or cancelled.
+ */
+uint8 flashStoreBegin(uint16 offset);
+/**
+ * Drop a page which is still being filled, e.g. because its transfer was
+ * cut short, and let EEPROM writes carry on.
+ */
+void flashStoreCancel();
+/**
+ * Stage len bytes, at most one packet, for flashStorePoll() to copy into
+ * the page buffer. Returns the number of bytes which fit in the current
+ * page. Nothing more can be staged until flashStoreBusy() is zero.
+ */
+uint8 flashStoreWrite(uint8 *data, uint8 len);
+/**
+ * Mark the page buffer as ready to be programmed by flashStorePoll().
+ */
+void flashStoreEnd();
+/**
+ * Copies staged bytes into the page buffer once the EEPROM queue can be
+ * held, and programs a completed page. This halts the CPU for two flash
+ * write cycles, so must be called from the main loop, after usbPoll().
+ */
+void flashStorePoll();
+/**
+ * Non-zero while bytes are staged or a page is waiting to be programmed
+ */
+uint8 flashStoreBusy();
+#endif
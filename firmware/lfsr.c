@@ -0,0 +1,40 @@
+/* 16 bit Galois LFSR, used to randomise colours as they are read.
+ *
+ * The taps give the maximal period of 65535. Each byte takes 8 shifts, so
+ * consecutive bytes do not share bits.
+ */
+#include "lfsr.h"
+
+#define LFSR_TAPS           (0xb400)
+#define LFSR_DEFAULT_SEED   (0xace1)
+
+uint16 _lfsr = LFSR_DEFAULT_SEED;
+
+void lfsrSeed(uint16 seed) {
+  _lfsr = seed ? seed : LFSR_DEFAULT_SEED;
+}
+
+uint8 lfsrNext() {
+  uint8 i;
+  for (i = 0; i < 8; i++) {
+    if (_lfsr & 1) _lfsr = (_lfsr >> 1) ^ LFSR_TAPS;
+    else _lfsr >>= 1;
+  }
+  return _lfsr;
+}
+
+uint8 lfsrJitter(uint8 value, uint8 range) {
+  int16 v;
+  uint8 offset;
+
+  if (range == 0) return value;
+
+  // scale a random byte to [0, range] without a division, and use one of
+  // the bits which were not returned for the sign
+  offset = ((uint16)lfsrNext() * (range + 1)) >> 8;
+  if (_lfsr & 0x100) v = value + offset;
+  else v = value - offset;
+  if (v > UINT8_MAX) v = UINT8_MAX;
+  else if (v < 0) v = 0;
+  return v;
+}
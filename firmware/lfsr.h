@@ -0,0 +1,19 @@
+#include "types.h"
+
+#ifndef _LFSR_H
+#define _LFSR_H
+/**
+ * Restart the generator from seed. A seed of zero is replaced, since the
+ * generator would be stuck at zero.
+ */
+void lfsrSeed(uint16 seed);
+/**
+ * Return the next pseudo random byte
+ */
+uint8 lfsrNext();
+/**
+ * Return value moved by a random amount of at most range either way,
+ * kept within 0 to 255.
+ */
+uint8 lfsrJitter(uint8 value, uint8 range);
+#endif
@@ -28,104 +28,568 @@ at least be connected to INT0 as well.
 #include "config.h"
 #include "types.h"
 #include "ctrBlock.h"
+#include "eeStore.h"
+#include "flashStore.h"
+#include "stack.h"
 #include "rgb.h"
 
 /* ------------------------------------------------------------------------- */
 /* ----------------------------- USB interface ----------------------------- */
 /* ------------------------------------------------------------------------- */
 
-PROGMEM char const usbHidReportDescriptor[22] = {    /* USB report descriptor */
+PROGMEM char const usbHidReportDescriptor[USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH] = {    /* USB report descriptor */
   0x06, 0x00, 0xff,              // USAGE_PAGE (Generic Desktop)
   0x09, 0x01,                    // USAGE (Vendor Usage 1)
   0xa1, 0x01,                    // COLLECTION (Application)
   0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
   0x26, 0xff, 0x00,              //   LOGICAL_MAXIMUM (255)
   0x75, 0x08,                    //   REPORT_SIZE (8)
+
+  0x85, REPORT_COMMAND,          //   REPORT_ID (REPORT_COMMAND)
+  0x95, COMMAND_SIZE,            //   REPORT_COUNT (COMMAND_SIZE)
+  0x09, 0x00,                    //   USAGE (Undefined)
+  0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
+
+  0x85, REPORT_DATA,             //   REPORT_ID (REPORT_DATA)
+#if USB_CFG_LONG_TRANSFERS
+  0x96, 0x00, 0x04,              //   REPORT_COUNT (1024)
+#else
   0x95, 0x80,                    //   REPORT_COUNT (128)
+#endif
+  0x09, 0x00,                    //   USAGE (Undefined)
+  0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
+
+  0x85, REPORT_STATUS,           //   REPORT_ID (REPORT_STATUS)
+  0x95, STATUS_SIZE,             //   REPORT_COUNT (STATUS_SIZE)
+  0x09, 0x00,                    //   USAGE (Undefined)
+  0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
+
+  0x85, REPORT_CRC,              //   REPORT_ID (REPORT_CRC)
+  0x95, CRC_SIZE,                //   REPORT_COUNT (CRC_SIZE)
   0x09, 0x00,                    //   USAGE (Undefined)
   0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
+
+  0x85, REPORT_PATCH,            //   REPORT_ID (REPORT_PATCH)
+  0x95, PATCH_SIZE,              //   REPORT_COUNT (PATCH_SIZE)
+  0x09, 0x00,                    //   USAGE (Undefined)
+  0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
+
+  0x85, REPORT_CAPS,             //   REPORT_ID (REPORT_CAPS)
+  0x95, CAPS_SIZE,               //   REPORT_COUNT (CAPS_SIZE)
+  0x09, 0x00,                    //   USAGE (Undefined)
+  0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
+
+  0x85, REPORT_TELEMETRY,        //   REPORT_ID (REPORT_TELEMETRY)
+  0x95, TELEMETRY_SIZE,          //   REPORT_COUNT (TELEMETRY_SIZE)
+  0x09, 0x00,                    //   USAGE (Undefined)
+  0x81, 0x02,                    //   INPUT (Data,Var,Abs)
   0xc0                           // END_COLLECTION
 };
-/* Since we define only one feature report, we don't use report-IDs (which
- * would be the first byte of the report). The entire report consists of 128
- * opaque data bytes.
+/* Commands and status have small reports of their own, so that they are
+ * not described, and by some hosts sent, as a full data report. Every
+ * report starts with its report ID, see config.h. The data report is 128
+ * opaque bytes, or 1024 with long transfers so that a whole EEPROM image
+ * fits in one. The input report is the telemetry packet, sent on the
+ * interrupt-in endpoint.
  */
 
+/* Commands runCommand() and usbFunctionWrite() take */
+#define CMD_BIT(cmd)      (1UL << (cmd))
+#define COMMANDS          (CMD_BIT(CMD_READ_AT) | CMD_BIT(CMD_WRITE) | \
+                           CMD_BIT(CMD_WRITE_AT) | CMD_BIT(CMD_RESTART) | \
+                           CMD_BIT(CMD_GOTO) | CMD_BIT(CMD_GOTO_SEQ) | \
+                           CMD_BIT(CMD_WRITE_SEQ) | CMD_BIT(CMD_WRITE_FLASH) | \
+                           CMD_BIT(CMD_COMMIT) | CMD_BIT(CMD_SPEED) | \
+                           CMD_BIT(CMD_PAUSE) | CMD_BIT(CMD_RESUME) | \
+                           CMD_BIT(CMD_STEP) | CMD_BIT(CMD_SEEK) | \
+                           CMD_BIT(CMD_OVERLAY) | CMD_BIT(CMD_TELEMETRY) | \
+                           CMD_BIT(CMD_LIVE) | CMD_BIT(CMD_BATCH) | \
+                           CMD_BIT(CMD_CRC) | CMD_BIT(CMD_PATCH) | \
+                           CMD_BIT(CMD_PERSIST))
+
+/* transferLength() allows more, but the data report is 1024 bytes */
+#if USB_CFG_LONG_TRANSFERS
+#define MAX_TRANSFER      1024
+#else
+#define MAX_TRANSFER      253
+#endif
+
+/* REPORT_CAPS, report ID first. It is fixed at build time, so it stays in
+ * flash and usbFunctionRead() sends it from there. */
+PROGMEM uchar const caps[1 + CAPS_SIZE] = {
+  REPORT_CAPS,
+  USB_CFG_DEVICE_VERSION,
+  EEPROM_SIZE & 0xff, EEPROM_SIZE >> 8,
+  EEPROM_BANKS,
+  COMMANDS & 0xff, (COMMANDS >> 8) & 0xff,
+  (COMMANDS >> 16) & 0xff, COMMANDS >> 24,
+  OPCODES & 0xff, OPCODES >> 8,
+  RGB_OPTIONS,
+  SEQ_FLAGS,
+  MAX_TRANSFER & 0xff, MAX_TRANSFER >> 8,
+  MS_PER_TICK
+};
+
+/* V-USB hands us data in packets of at most this many bytes */
+#define USB_PACKET_SIZE   8
+
 /* The following variables store the status of the current data transfer */
-static uchar  currentAddress;
-static uchar  bytesRemaining;
+static uint16 currentAddress;
+static uint16 bankBase;
+static uint16 writeEnd;
+static usbMsgLen_t bytesRemaining;
 static uchar  command;
+
+/* Directory entry of a WRITE_SEQ in progress, written once all its blocks
+ * have arrived. The last packet may leave no room in the queue for it, so
+ * the main loop writes it, with requests held off until then. */
+static uchar        seqId;
+static SeqDirEntry  seqEntry;
+static uchar        seqPending;
+
+/* Set by CMD_READ_AT, where the next read starts */
+static uint16 readAddress;
+
+/* The command of a CMD_BATCH being gathered, its length, or 0 while
+ * waiting for the length, and how far it has got. STATUS_BATCH is
+ * batchStatus.
+ */
+#define BATCH_STOP    (0xff)
+static uchar  batchEntry[BATCH_ENTRY_SIZE];
+static uchar  batchLength;
+static uchar  batchPos;
+static uchar  batchStatus;
+
+/* commands which run over several packets, and cannot be batched */
+#define STREAMING(cmd)  ((cmd) == CMD_WRITE || (cmd) == CMD_WRITE_AT || \
+                         (cmd) == CMD_WRITE_SEQ || (cmd) == CMD_WRITE_FLASH || \
+                         (cmd) == CMD_BATCH)
+
+/* The rest of a report whose command has been run or refused, which is
+ * dropped as it arrives rather than taken for another command */
+#define CMD_SKIP        (0xfe)
+
+/* Set while the report ID of a REPORT_DATA read has not been sent */
+static uchar  readReportId;
+/* Set while REPORT_CAPS is read rather than EEPROM */
+static uchar  readCaps;
+
+/* REPORT_STATUS, REPORT_CRC and REPORT_PATCH, report ID first. Only one is
+ * sent at a time, and REPORT_PATCH is the longest. */
+static uchar  status[1 + PATCH_SIZE];
+
+/* Ticks between telemetry packets, 0 for none, and when the last was sent */
+static uint16 telemetryPeriod;
+static uint16 telemetrySent;
+/* Telemetry flags which push a packet as soon as they are raised */
+static uchar  telemetryEvents;
+/* REPORT_TELEMETRY, report ID first, which takes two interrupt packets.
+ * telemetryLeft is the number of bytes still to go. */
+static uchar  telemetry[1 + TELEMETRY_SIZE];
+static uchar  telemetryLeft;
 /* ------------------------------------------------------------------------- */
 
 /* usbFunctionRead() is called when the host requests a chunk of data from
  * the device. For more information see the documentation in usbdrv/usbdrv.h.
  */
 uchar usbFunctionRead(uchar *data, uchar len) {
+  uchar sent = 0;
+
   if(len > bytesRemaining) len = bytesRemaining;
+  if(readCaps) {
+    memcpy_P(data, caps + currentAddress, len);
+    currentAddress += len;
+    bytesRemaining -= len;
+    return len;
+  }
+
+  if(len && readReportId) {
+    readReportId = 0;
+    *data++ = REPORT_DATA;
+    len -= 1;
+    bytesRemaining -= 1;
+    sent = 1;
+  }
+
+  if(currentAddress >= EEPROM_SIZE) len = 0;
+  else if(currentAddress + len > EEPROM_SIZE) len = EEPROM_SIZE - currentAddress;
 
-  eeprom_read_block(data, (uchar *)0 + currentAddress, len);
+  eeStoreRead(data, currentAddress, len);
   currentAddress += len;
   bytesRemaining -= len;
 
-  return len;
+  return sent + len;
+}
+
+/* The data bytes cmd needs, not counting optional ones */
+static uchar commandLength(uchar cmd) {
+  switch (cmd) {
+    case CMD_GOTO: case CMD_GOTO_SEQ: case CMD_OVERLAY:
+      return 1;
+    case CMD_READ_AT: case CMD_SEEK: case CMD_SPEED: case CMD_TELEMETRY:
+      return 2;
+    case CMD_LIVE:
+      return 3;
+    case CMD_CRC:
+      return 4;
+    case CMD_PATCH:
+      return 5;
+  }
+  return 0;
+}
+
+/* The bytes cmd queues for EEPROM */
+static uchar commandWrites(uchar cmd) {
+  if (cmd == CMD_COMMIT) return 2;
+  if (cmd == CMD_PERSIST) return sizeof(ControlBlock);
+  return 0;
+}
+
+/* Optional data byte i, or ARG_DEFAULT if the report stops before it */
+static uchar optional(uchar *data, uchar len, uchar i) {
+  return len > i ? data[i] : ARG_DEFAULT;
+}
+
+/* Runs a command which is complete in the len bytes of data following the
+ * command byte. Returns zero if the command was refused. Unknown commands
+ * are ignored.
+ */
+static uchar runCommand(uchar cmd, uchar *data, uchar len) {
+  uchar arg;
+
+  // a short report is refused rather than run on stale bytes
+  if (len < commandLength(cmd)) return 0;
+
+  if (cmd == CMD_GOTO || cmd == CMD_GOTO_SEQ) {
+    // there should be one data byte, and an optional crossfade time
+    arg = optional(data, len, 1);
+    if (cmd == CMD_GOTO)
+      rgbGoto(data[0], arg == ARG_DEFAULT ? NO_CROSSFADE : arg);
+    else
+      rgbGotoSequence(data[0], arg == ARG_DEFAULT ? NO_CROSSFADE : arg);
+  } else if (cmd == CMD_PAUSE || cmd == CMD_RESUME) {
+    rgbPause(cmd == CMD_PAUSE);
+  } else if (cmd == CMD_STEP) {
+    rgbStep();
+  } else if (cmd == CMD_SEEK) {
+    return rgbSeek(data[0] | (data[1] << 8));
+  } else if (cmd == CMD_COMMIT) {
+    return ctrBlockCommit();
+  } else if (cmd == CMD_SPEED) {
+    rgbSetSpeed(data[0] | (data[1] << 8));
+  } else if (cmd == CMD_OVERLAY) {
+    // ARG_DEFAULT is also full alpha
+    arg = optional(data, len, 1);
+    rgbOverlay(data[0], arg == ARG_DEFAULT ? BLEND_ALPHA : arg,
+               optional(data, len, 2));
+  } else if (cmd == CMD_LIVE) {
+    rgbLive(data[0], data[1], data[2], len > 3 ? data[3] : 0);
+  } else if (cmd == CMD_TELEMETRY) {
+    telemetryPeriod = data[0] | (data[1] << 8);
+    arg = optional(data, len, 2);
+    if (arg != ARG_DEFAULT) telemetryEvents = arg;
+  } else if (cmd == CMD_PATCH) {
+    ControlBlock cb;
+
+    cb.r = data[1];
+    cb.g = data[2];
+    cb.b = data[3];
+    cb.duration = data[4];
+    return rgbPatch(data[0], &cb);
+  } else if (cmd == CMD_PERSIST) {
+    return ctrBlockPersist();
+  } else if (cmd == CMD_CRC) {
+    eeStoreCrcBegin(data[0] | (data[1] << 8), data[2] | (data[3] << 8));
+  } else if (cmd == CMD_READ_AT) {
+    readAddress = data[0] | (data[1] << 8);
+  } else if (cmd == CMD_RESTART) {
+    // there should be no more data bytes
+    rgbSetup();
+  }
+  return 1;
 }
 
 #define END_COMMAND()     do {command=CMD_NONE;return 1;}while(0)
+#define REFUSE()          do {skipRest(len);return 0xff;}while(0)
+
+/* Counts the len bytes of this packet off the report, and skips whatever
+ * is left of it */
+static void skipRest(uchar len) {
+  if(len > bytesRemaining)
+    len = bytesRemaining;
+  bytesRemaining -= len;
+  command = bytesRemaining ? CMD_SKIP : CMD_NONE;
+}
+
 /* usbFunctionWrite() is called when the host sends a chunk of data to the
  * device. For more information see the documentation in usbdrv/usbdrv.h.
  */
 uchar usbFunctionWrite(uchar *data, uchar len) {
+  uchar c;
+
   if (command == CMD_NONE) {
-    command = data[0];
-    data += 1;
-    len -= 1;
+    // the report ID comes first. Either report may carry any command.
+    if (len < 2) return 1;
+    command = data[1];
+    data += 2;
+    len -= 2;
 
     // if we consumed a command byte, that is one less byte waiting to be
     // read from the host
-    bytesRemaining -= 1;
+    bytesRemaining -= 2;
+
+    if (command == CMD_WRITE || command == CMD_WRITE_AT || command == CMD_WRITE_SEQ)
+      eeStoreResetCount();
+
+    if (command == CMD_WRITE) {
+      // uploads go to the bank after the playing one, which must not be
+      // about to start playing
+      if (ctrBlockSwitching()) {
+        REFUSE();
+      }
+      bankBase = ((ctrBlockBank() + 1) % EEPROM_BANKS) * BANK_SIZE;
+      writeEnd = BANK_SIZE;
+    } else if (command == CMD_WRITE_AT) {
+      // the offset is all in this first chunk
+      if (len < 2) END_COMMAND();
+      currentAddress = data[0] | (data[1] << 8);
+      bankBase = 0;
+      writeEnd = EEPROM_SIZE;
+      data += 2;
+      len -= 2;
+      bytesRemaining -= 2;
+    } else if (command == CMD_WRITE_SEQ) {
+      // the directory entry follows the sequence ID, and is all in this
+      // first chunk
+      if (len < 5) END_COMMAND();
+      seqId = data[0];
+      seqEntry.start = data[1] | (data[2] << 8);
+      seqEntry.length = data[3];
+      seqEntry.flags = data[4];
+      if (!ctrBlockBeginSequence(seqId, &seqEntry)) {
+        REFUSE();
+      }
+
+      currentAddress = seqEntry.start;
+      bankBase = ctrBlockBank() * BANK_SIZE;
+      data += 5;
+      len -= 5;
+      bytesRemaining -= 5;
+    } else if (command == CMD_WRITE_FLASH) {
+      if (len < 2) END_COMMAND();
+      if (!flashStoreBegin(data[0] | (data[1] << 8))) {
+        REFUSE();
+      }
+
+      data += 2;
+      len -= 2;
+      bytesRemaining -= 2;
+    } else if (command == CMD_BATCH) {
+      batchLength = 0;
+      batchStatus = 0;
+    }
   }
 
-  if (command == CMD_WRITE) {
+  if (command == CMD_WRITE || command == CMD_WRITE_AT) {
     if(bytesRemaining) {
       if(len > bytesRemaining)
         len = bytesRemaining;
+      bytesRemaining -= len;
+
+      if (currentAddress >= writeEnd)
+        len = 0;
+      else if (currentAddress + len > writeEnd)
+        len = writeEnd - currentAddress;
 
-      eeprom_write_block(data, (uchar *)0 + currentAddress, len);
+      // the first byte of the magic is left for COMMIT to write, so the
+      // bank is never picked after a reset until the upload is committed
+      if (command == CMD_WRITE && currentAddress == 0 && len)
+        data[0] = 0;
+
+      eeStoreWrite(bankBase + currentAddress, data, len);
       currentAddress += len;
-      bytesRemaining -= len;
     }
     if (bytesRemaining == 0) END_COMMAND();
-    else return 0;
-  } else if (command == CMD_GOTO) {
-    // there should one data byte
-    ctrBlockGoto(data[0]);
-    END_COMMAND();
-  } else if (command == CMD_RESTART) {
-    // there should be no more data bytes
-    rgbSetup();
-    END_COMMAND();
-  } else END_COMMAND();
+    else {
+      // hold off the host until the queue has room for another packet
+      if (eeStoreFree() < USB_PACKET_SIZE) usbDisableAllRequests();
+      return 0;
+    }
+  } else if (command == CMD_WRITE_SEQ) {
+    uint16 seqEnd = seqEntry.start + seqEntry.length * sizeof(ControlBlock);
+    if(bytesRemaining) {
+      if(len > bytesRemaining)
+        len = bytesRemaining;
+      bytesRemaining -= len;
+
+      // never spill over into whatever follows the sequence. The blocks
+      // of sequences in user flash are written with WRITE_FLASH instead
+      if (seqEntry.flags & SEQ_USERFLASH)
+        len = 0;
+      else if (currentAddress + len > seqEnd)
+        len = seqEnd - currentAddress;
+
+      eeStoreWrite(bankBase + currentAddress, data, len);
+      currentAddress += len;
+    }
+    if (bytesRemaining == 0) {
+      seqPending = 1;
+      usbDisableAllRequests();
+      END_COMMAND();
+    } else {
+      if (eeStoreFree() < USB_PACKET_SIZE) usbDisableAllRequests();
+      return 0;
+    }
+  } else if (command == CMD_WRITE_FLASH) {
+    if(len > bytesRemaining)
+      len = bytesRemaining;
+    bytesRemaining -= len;
+
+    // anything past the end of the page is dropped. The packet is only
+    // staged, so hold off the next until flashStorePoll() has taken it.
+    flashStoreWrite(data, len);
+    usbDisableAllRequests();
+    if (bytesRemaining == 0) {
+      flashStoreEnd();
+      END_COMMAND();
+    } else return 0;
+  } else if (command == CMD_BATCH) {
+    if(len > bytesRemaining)
+      len = bytesRemaining;
+    bytesRemaining -= len;
+
+    // commands may be split across packets, so they are gathered into
+    // batchEntry first
+    while (len--) {
+      c = *data++;
+
+      if (batchLength == BATCH_STOP) continue;
+      if (batchLength == 0) {
+        // a length of 0 ends the batch, so padding is ignored
+        if (c == 0) batchLength = BATCH_STOP;
+        else if (c > BATCH_ENTRY_SIZE) {
+          batchStatus |= STATUS_BATCH_FAILED;
+          batchLength = BATCH_STOP;
+        } else {
+          batchLength = c;
+          batchPos = 0;
+        }
+      } else {
+        batchEntry[batchPos++] = c;
+        if (batchPos == batchLength) {
+          // the queue only had room for a packet when the report started,
+          // and usbFunctionWrite() must not wait for it
+          if (STREAMING(batchEntry[0]) ||
+              eeStoreFree() < commandWrites(batchEntry[0]) ||
+              !runCommand(batchEntry[0], batchEntry + 1, batchLength - 1)) {
+            batchStatus |= STATUS_BATCH_FAILED;
+            batchLength = BATCH_STOP;
+          } else {
+            batchStatus += 1;
+            batchLength = 0;
+          }
+        }
+      }
+    }
+    if (bytesRemaining == 0) {
+      // the report ended part way through a command
+      if (batchLength && batchLength != BATCH_STOP)
+        batchStatus |= STATUS_BATCH_FAILED;
+      END_COMMAND();
+    } else {
+      // a batch may hold commands which write EEPROM
+      if (eeStoreFree() < USB_PACKET_SIZE) usbDisableAllRequests();
+      return 0;
+    }
+  } else if (command == CMD_SKIP) {
+    skipRest(len);
+    return command == CMD_NONE;
+  } else {
+    c = runCommand(command, data, len);
+    skipRest(len);
+    if (!c) return 0xff;
+    return command == CMD_NONE;
+  }
 }
 
 /* ------------------------------------------------------------------------- */
 
+static usbMsgLen_t transferLength(usbRequest_t *rq) {
+#if USB_CFG_LONG_TRANSFERS
+  // USB_NO_MSG is 0xffff here, far beyond anything we store
+  return rq->wLength.word == USB_NO_MSG ? USB_NO_MSG - 1 : rq->wLength.word;
+#else
+  return rq->wLength.bytes[1] || rq->wLength.bytes[0] == 255 ? 254 : rq->wLength.bytes[0];
+#endif
+}
+
 usbMsgLen_t usbFunctionSetup(uchar data[8]) {
   usbRequest_t *rq = (void *)data;
 
   // XXX as per documented in usbdrv.h, the maximum data we can
-  // transfer per exchange is 254 bytes. We thus truncate
-  // bytesRemaining if it is over this limit
+  // transfer per exchange is 254 bytes unless USB_CFG_LONG_TRANSFERS is set.
+  // We thus truncate bytesRemaining if it is over this limit
   if((rq->bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_CLASS) {  /* HID class request */
+    // a new request ends the last transfer, whether or not it got to the
+    // end of its page
+    flashStoreCancel();
+
     if(rq->bRequest == USBRQ_HID_GET_REPORT) {  /* wValue: ReportType (highbyte), ReportID (lowbyte) */
-      bytesRemaining = rq->wLength.bytes[0];
-      if (bytesRemaining == 255) bytesRemaining = 254;
-      currentAddress = 0;
-      return USB_NO_MSG;  /* use usbFunctionRead() to obtain data */
+      if (rq->wValue.bytes[0] == REPORT_STATUS) {
+        uchar *report = status + 1;
+        uint16 written = eeStoreCount();
+
+        status[0] = REPORT_STATUS;
+        report[STATUS_WRITTEN] = written & 0xff;
+        report[STATUS_WRITTEN+1] = written >> 8;
+        report[STATUS_PENDING] = eeStorePending();
+        report[STATUS_BANK] = ctrBlockBank();
+        if (ctrBlockSwitching()) report[STATUS_BANK] |= STATUS_BANK_SWITCHING;
+        report[STATUS_BATCH] = batchStatus;
+        report[STATUS_STACK] = stackUnused();
+        usbMsgPtr = status;
+        return 1 + STATUS_SIZE;
+      } else if (rq->wValue.bytes[0] == REPORT_CRC) {
+        uchar *report = status + 1;
+        uint16 crc = eeStoreCrc();
+        uint16 left = eeStoreCrcLeft();
+
+        status[0] = REPORT_CRC;
+        report[CRC_VALUE] = crc & 0xff;
+        report[CRC_VALUE+1] = crc >> 8;
+        report[CRC_LEFT] = left & 0xff;
+        report[CRC_LEFT+1] = left >> 8;
+        usbMsgPtr = status;
+        return 1 + CRC_SIZE;
+      } else if (rq->wValue.bytes[0] == REPORT_PATCH) {
+        status[0] = REPORT_PATCH;
+        ctrBlockPatchReport(status + 1);
+        usbMsgPtr = status;
+        return 1 + PATCH_SIZE;
+      } else if (rq->wValue.bytes[0] == REPORT_CAPS) {
+        bytesRemaining = transferLength(rq);
+        if (bytesRemaining > sizeof(caps)) bytesRemaining = sizeof(caps);
+        currentAddress = 0;
+        readCaps = 1;
+        return USB_NO_MSG;  /* use usbFunctionRead() to obtain data */
+      } else if (rq->wValue.bytes[0] == REPORT_DATA) {
+        bytesRemaining = transferLength(rq);
+        currentAddress = readAddress;
+        readAddress = 0;
+        readReportId = 1;
+        readCaps = 0;
+        return USB_NO_MSG;  /* use usbFunctionRead() to obtain data */
+      }
     } else if(rq->bRequest == USBRQ_HID_SET_REPORT) {
-      bytesRemaining = rq->wLength.bytes[0];
-      if (bytesRemaining == 255) bytesRemaining = 254;
-      currentAddress = 0;
-      return USB_NO_MSG;  /* use usbFunctionWrite() to receive data from host */
+      if (rq->wValue.bytes[0] == REPORT_COMMAND || rq->wValue.bytes[0] == REPORT_DATA) {
+        // hold the first packet off until the queue has room for all of it,
+        // so that usbFunctionWrite() never waits for EEPROM
+        if (eeStoreFree() < USB_PACKET_SIZE) usbDisableAllRequests();
+        bytesRemaining = transferLength(rq);
+        currentAddress = 0;
+        command = CMD_NONE;
+        return USB_NO_MSG;  /* use usbFunctionWrite() to receive data from host */
+      }
     }
   } else {
     /* ignore vendor type requests, we don't use any */
@@ -139,6 +603,8 @@ int main(void) {
   uchar   i;
 
   command = CMD_NONE;
+  telemetryPeriod = TELEMETRY_PERIOD;
+  telemetryEvents = TELEMETRY_EVENTS;
 
   wdt_enable(WDTO_1S);
   /* Even if you don't use the watchdog, turn it off here. On newer devices,
@@ -168,7 +634,37 @@ int main(void) {
     usbPoll();
     wdt_reset();
     usbPoll();
+    flashStorePoll();
+    eeStorePoll();
     rgbPoll();
+
+    if (seqPending && eeStoreFree() >= sizeof(seqEntry)) {
+      ctrBlockSetSequence(seqId, &seqEntry);
+      seqPending = 0;
+    }
+    if (usbAllRequestsAreDisabled() && !seqPending && !flashStoreBusy() &&
+        eeStoreFree() >= USB_PACKET_SIZE)
+      usbEnableAllRequests();
+
+    // a packet the host has not taken yet is left alone, so a host which
+    // is not listening costs us nothing, and events pile up into the next.
+    // The report ID makes the report one byte longer than a packet, and
+    // the short second packet ends it. A new report is only built once
+    // both packets of the last have gone, so the two never interleave.
+    if (usbInterruptIsReady()) {
+      if (telemetryLeft) {
+        usbSetInterrupt(telemetry + sizeof(telemetry) - telemetryLeft, telemetryLeft);
+        telemetryLeft = 0;
+      } else if ((rgbEvents() & telemetryEvents) ||
+                 (telemetryPeriod &&
+                  (uint16)(rgbTicks() - telemetrySent) >= telemetryPeriod)) {
+        telemetrySent = rgbTicks();
+        telemetry[0] = REPORT_TELEMETRY;
+        rgbTelemetry(telemetry + 1);
+        usbSetInterrupt(telemetry, USB_PACKET_SIZE);
+        telemetryLeft = sizeof(telemetry) - USB_PACKET_SIZE;
+      }
+    }
   }
   return 0;
 }
@@ -182,6 +678,11 @@ void hadUsbReset() {
   int bestDeviation = 9999;
   uchar trialCal, bestCal, step, region, hasBestCal;
 
+  // drop a report cut in half by the reset, so that the host never takes
+  // its second packet for the start of a report
+  telemetryLeft = 0;
+  usbTxLen1 = USBPID_NAK;
+  flashStoreCancel();
 
   // do a binary search in regions 0-127 and 128-255 to get optimum OSCCAL
   for(region = hasBestCal = 0; region <= 1; region++) {
@@ -9,29 +9,40 @@
  * intensity.
  *
  * duration also unsigned and specified a time interval, and has units of
- * 2*MS_PER_TICK. Not all durations are valid. See below. Furthermore,
- * because colour delta per unit duration is stored as integers, we can not
- * satisfy all transition requirements, namely those which require
- * intensity change per unit duration is less than 1. e.g. going from 0 to 10
- * over 200 unit duration. When this is encountered, the value is immediately
- * set to the average of the current intensity and the target intensity
+ * 2*MS_PER_TICK. Not all durations are valid. See below. Colours follow
+ * how far through its duration a step is, so that small changes over long
+ * durations are smooth.
+ * Longer durations are given with OP_TIME, see below.
  *
  * Each control block specifies the colour to transition to, and how
  * long that transition should take.
  *
- * The first control block is special. The first 3 bytes must have values of:
+ * The first control block is special. The first 2 bytes must have values of:
  *
- *   0xfa 0xe2 0x11
- * The 4th byte specifies special options. These optons are:
+ *   0xfa 0xe2
  *
- *  - RGB_REVERSE
- *  - RGB_RANDOM_ON_READ
+ * and the 3rd is the format version, SETUP_V2 (0x12). Images with SETUP_V1
+ * (0x11) predate the options, and are played without any. The 4th byte
+ * specifies special options. These optons are:
+ *
+ *  - RGB_REVERSE (bit 0)
+ *  - RGB_RANDOM_ON_READ (bit 1)
+ *  - RGB_DIRECTORY (bit 2)
+ *
+ * Bits 6 and 7 are SETUP_GENERATION, which CMD_COMMIT sets, see Banks.
  *
  * RGB_REVERSE when set will cause the block to run backwards when it
  * reaches the end.
  *
  * RGB_RANDOM_ON_READ will modify the intensity values after reading them so
- * next time it is read, the values will be different.
+ * next time it is read, the values will be different. Only the copy in RAM
+ * is changed, see lfsr.c. The setup block is then followed by the jitter
+ * block:
+ *
+ *   red range, green range, blue range, seed
+ *
+ * Each intensity moves by at most its range either way, and the same seed
+ * gives the same pattern after every restart.
  *
  * Control blocks are read until a delimiter block is encountered, or until the
  * end of EEPROM. At this point, the entire block will repeat again starting
@@ -55,6 +66,99 @@
  * Delimter blocks allow discrete sequences to be stored in EEPROM and
  * recalled at need. This minimises the number of required EEPROM writes.
  *
+ * Opcodes
+ * =======
+ * Durations from 0xf0 (OP_FIRST) up are opcodes, run by the VM in
+ * ctrBlock.c, with red, green and blue as operands:
+ *
+ *  - OP_LOOP (0xf8) count: repeat up to the matching OP_ENDLOOP count
+ *    times, or forever if count is 0.
+ *  - OP_ENDLOOP (0xf9): end of the innermost loop.
+ *  - OP_JUMP (0xfa) lo hi: continue at block lo + 256*hi of the sequence.
+ *  - OP_CALL (0xfb) id: play sequence id, then carry on after the call.
+ *  - OP_RET (0xfc): return from a called sequence, as its end does.
+ *  - OP_HOLD (0xfd) duration: stay at the colour of the previous step.
+ *  - OP_JITTER (0xf7) red green blue: jitter ranges until another sequence
+ *    is selected, with or without RGB_RANDOM_ON_READ.
+ *  - OP_TIME (0xf5) lo hi scale: the next step lasts lo + 256*hi units,
+ *    times 1, 16 or 256 for a scale of 0, 1 or 2.
+ *  - OP_EFFECT (0xf6) type period depth: see Effects.
+ *
+ * Loops and calls of every track share VM_STACK_SIZE frames. A loop which
+ * does not fit plays once, a call which does not fit is skipped, as are
+ * unknown opcodes. After 16 opcodes without a step the colour is held
+ * briefly.
+ *
+ * e.g. flash white 3 times, fade to blue, and repeat 10 times:
+ *
+ *   0a 00 00 f8   loop 10 times
+ *   03 00 00 f8     loop 3 times
+ *   ff ff ff 00       white
+ *   00 00 00 05       fade out
+ *   00 00 00 f9     end loop
+ *   00 00 ff 32     fade to blue
+ *   00 00 00 f9   end loop
+ *
+ * Effects
+ * =======
+ * An effect is worked out every tick from the colour the blocks give,
+ * until another effect or sequence is selected. period is in units of
+ * 100ms, and depth out of 256:
+ *
+ *  - EFFECT_NONE (0)
+ *  - EFFECT_BREATHE (1): the brightness follows a sine wave, dipping by
+ *    depth.
+ *  - EFFECT_RAINBOW (2): the colour goes around depth of the colour wheel
+ *    from red, all the way round at 0xff, otherwise there and back.
+ *  - EFFECT_CANDLE (3): the brightness drifts to a random level, up to
+ *    depth below full, once a period.
+ *  - EFFECT_STROBE (4): the colour is on for depth of each period.
+ *
+ * e.g. a rainbow which takes 10 seconds to go around:
+ *
+ *   02 64 ff f6   rainbow effect
+ *   ff ff ff ef   full brightness
+ *
+ * Overlay and live frames
+ * =======================
+ * CMD_OVERLAY plays a sequence once over the base sequence, which carries
+ * on underneath, blended after any effect. It plays to its end or first
+ * delimiter, and cannot be split or set an effect. CMD_LIVE sets the base
+ * layer directly, holding the tracks where they are until frames stop.
+ *
+ * Sequence directory
+ * ==================
+ * With RGB_DIRECTORY, the SEQ_DIR_ENTRIES blocks after the setup block, and
+ * jitter block if any, are a directory, indexed by sequence ID:
+ *
+ *   start (low byte), start (high byte), length, flags
+ *
+ * start is the offset of the first block, after the directory, and length
+ * the number of blocks. Entries with a length of 0, or which do not fit,
+ * are unused. Sequence 0 plays after a restart. flags may contain:
+ *
+ *  - SEQ_ONCE (bit 0): play once and hold the last block.
+ *  - SEQ_USERFLASH (bit 1): the blocks are in the user flash region, and
+ *    start is an offset into it. See CMD_WRITE_FLASH.
+ *  - SEQ_SPLIT (bit 2): sequences id, id+1 and id+2 drive red, green and
+ *    blue as separate tracks, each with its own durations, loops and calls.
+ *    If id+1 or id+2 is not valid, id plays as usual.
+ *
+ * Banks
+ * =====
+ * EEPROM holds EEPROM_BANKS images of BANK_SIZE bytes, each with its own
+ * setup block, and offsets are relative to the bank. Uploads go to the
+ * bank after the one which is playing, without the first byte of the
+ * magic. CMD_COMMIT checks the bank, sets SETUP_GENERATION one on from the
+ * playing bank, writes the missing byte and switches at the next block
+ * boundary. After a restart the newest committed bank plays.
+ *
+ * Sequence library
+ * ================
+ * The .seq files in firmware/seqlib/ are built into flash with IDs from
+ * SEQLIB_FIRST_ID on, and play like directory sequences. The first one
+ * plays if EEPROM has not been set up.
+ *
  * Timer1 and TIMER1_COMPB is used.
  */
 
@@ -65,6 +169,8 @@
 #include "config.h"
 #include "types.h"
 #include "ctrBlock.h"
+#include "eeStore.h"
+#include "effect.h"
 
 #include "rgb.h"
 
@@ -72,7 +178,6 @@
 // CYCLE_PER_TICK is equal to MS_PER_TICK _only_ for a timer running close
 // to 1KHz.
 #define CYCLE_PER_TICK        (10)
-#define MS_PER_TICK           (10)
 
 // it is unlikely this will change, but
 // this makes parts of the code clearer
@@ -95,6 +200,7 @@
 #endif
 
 volatile ElapsedTime _elapsedTime;
+volatile uint16 _ticks;
 volatile uint8 _error;
 
 ISR(BADISR_vect) {
@@ -102,6 +208,7 @@ ISR(BADISR_vect) {
 }
 
 ISR(TIMER1_COMPB_vect) {
+  _ticks += 1;
   _elapsedTime.ms += MS_PER_TICK;
   if (_elapsedTime.ms == MS_PER_SEC) {
     _elapsedTime.ms = 0;
@@ -122,47 +229,344 @@ void pwm(phase, intensity, bitpos) {
   else LED_OFF(bitpos);
 }
 
-int16 calcColorDelta(uint8 from, uint8 to, uint8 duration) {
-  int16 d;
-  if (from > to) d = -(from - to)/duration;
-  else d = (to - from)/duration;
+// the base layer, then the overlay
+#define OVERLAY_CHANNEL       (3)
+
+// each channel fades from _from to the colour its track is on. Rather than
+// keep a delta per channel, the colour is worked out from how far through
+// its step the track is, see fadeColours().
+uint8 _from[6];
+uint8 _colour[6];
+
+// for each track, the units of MS_PER_UNIT_DURATION in its current step,
+// and those left, each of which is _prescale units long. A prescale of 256
+// is kept as 0, which the count wraps round to.
+uint16 _total[TRACKS + 1];
+uint16 _duration[TRACKS + 1];
+uint8 _prescale[TRACKS + 1];
+uint8 _prescaleCount[TRACKS + 1];
+
+#define PRESCALE(track)       ((uint16)(uint8)(_prescale[track] - 1) + 1)
+
+// a single track drives every channel of the base layer, otherwise track n
+// drives channel n. The overlay has its own channels.
+#define FIRST_CHANNEL(track)  ((track) == OVERLAY ? OVERLAY_CHANNEL : \
+                               ctrBlockTracks() == 1 ? 0 : (track))
+#define LAST_CHANNEL(track)   ((track) == OVERLAY ? OVERLAY_CHANNEL + 3 : \
+                               ctrBlockTracks() == 1 ? 3 : (track) + 1)
+#define TARGET(cb, channel)   ((&(cb)->r)[(channel) % 3])
+
+// live frames take the base layer over from the tracks, which stay where
+// they are until the frames stop
+#define PLAYING(track)        ((track) == OVERLAY ? ctrBlockOverlayActive() : \
+                               !_live && (track) < ctrBlockTracks())
+
+// how the overlay is laid over the base layer
+uint8 _blend;
+uint8 _alpha;
+
+// playback speed, and the fraction of a unit carried over to the next
+// one, both in 8.8 fixed point
+uint16 _speed;
+uint16 _speedCount;
+
+// for each track, whole units the speed has given it which it has not used
+// yet, e.g. because its step ended part way through them
+uint8 _owed[TRACKS + 1];
+
+// set while live frames are shown, with the colour of the last frame, the
+// units in its fade and those left, and the tick it arrived on
+uint8 _live;
+ControlBlock _liveFrame;
+uint16 _liveTotal;
+uint16 _liveDuration;
+uint16 _liveTick;
+
+void copyColors(uint8 track, ControlBlock *cb) {
+  uint8 i;
+
+  for (i = FIRST_CHANNEL(track); i < LAST_CHANNEL(track); i++)
+    _from[i] = _colour[i] = TARGET(cb, i);
+}
 
-  // the +/-1 is so we over shoot when we have very small
-  // delta steps. 1.2, 1.4 will truncate to 1, causing
-  // undershoot. Aesthetically, it seems better to overshoot.
-  // Large d is, smaller the effect this modification has.
-  if (d) {
-    if (d>0) d += 1;
-    else d -= 1;
+/**
+ * Work out the colour of the channels from first up to last, which are
+ * fading to cb and have left of total units to go
+ */
+void fadeColours(uint8 first, uint8 last, ControlBlock *cb, uint16 total,
+                 uint16 left) {
+  uint16 done;
+  uint8 i, to;
+
+  // scale both down until the division is 16 bits wide, which is out by
+  // at most 1/128th of the fade
+  while (total > UINT8_MAX) {
+    total >>= 1;
+    left >>= 1;
+  }
+  done = left ? ((total - left) << 8) / total : 256;
+
+  for (i = first; i < last; i++) {
+    to = TARGET(cb, i);
+    if (to >= _from[i])
+      _colour[i] = _from[i] + (((uint16)(to - _from[i]) * done) >> 8);
+    else
+      _colour[i] = _from[i] - (((uint16)(_from[i] - to) * done) >> 8);
   }
+}
 
-  return d;
+/**
+ * Start fading the channels of track from their current colour to cb, over
+ * duration units which are prescale units long
+ */
+void startFade(uint8 track, ControlBlock *cb, uint16 duration, uint16 prescale) {
+  uint8 i;
+
+  _total[track] = duration;
+  _duration[track] = duration;
+  _prescale[track] = (uint8)prescale;
+  _prescaleCount[track] = (uint8)prescale;
+
+  if (duration) {
+    for (i = FIRST_CHANNEL(track); i < LAST_CHANNEL(track); i++)
+      _from[i] = _colour[i];
+  } else copyColors(track, cb);
 }
 
-uint8 adjIntensity(uint8 i, int16 di) {
-  int16 ii = i + di;
-  if (ii > UINT8_MAX) ii = UINT8_MAX;
-  else if (ii < 0) ii = 0;
-  return ii;
+/**
+ * Start fading to the step cb, over the duration ctrBlock gives it
+ */
+void startStep(uint8 track, ControlBlock *cb) {
+  startFade(track, cb, ctrBlockDuration(track), ctrBlockPrescale(track));
 }
 
-uint8 _r, _g, _b;
-uint8 _duration;
+/**
+ * Forget the units every track is owed, when they all start over
+ */
+void clearOwed() {
+  uint8 track;
 
-void copyColors(ControlBlock *cb) {
-  _r = cb->r;
-  _g = cb->g;
-  _b = cb->b;
+  for (track = 0; track <= OVERLAY; track++) _owed[track] = 0;
+}
+
+/**
+ * Start every track on its current step, over fade units unless that is
+ * NO_CROSSFADE. Used when the sequence changes, or track 0 jumps.
+ */
+void startTracks(uint16 fade) {
+  uint8 track;
+
+  clearOwed();
+  for (track = 0; track < ctrBlockTracks(); track++) {
+    if (fade == NO_CROSSFADE) startStep(track, ctrBlockCurrent(track));
+    else startFade(track, ctrBlockCurrent(track), fade, 1);
+  }
+}
+
+/**
+ * Finish the current step of track, and start its next one
+ */
+void nextStep(uint8 track) {
+  uint8 switching = ctrBlockSwitching();
+
+  // first set ourselves to the value the control block specified, since we
+  // probably didn't hit it due to founding errors.
+  ControlBlock *cb = ctrBlockCurrent(track);
+  copyColors(track, cb);
+
+  cb = ctrBlockNext(track);
+
+  // a commit has taken effect, and every track starts over
+  if (switching && !ctrBlockSwitching()) startTracks(NO_CROSSFADE);
+  else if (cb) startStep(track, cb);
+}
+
+/**
+ * Move track on by one unit
+ */
+void consumeUnit(uint8 track) {
+  if (--_prescaleCount[track]) return;
+  _prescaleCount[track] = _prescale[track];
+  _duration[track] -= 1;
+}
+
+/**
+ * Move the fade to the live frame on by one unit. Live frames run on real
+ * time, whatever the speed, and whether or not playback is paused.
+ */
+void liveUnit() {
+  if (_liveDuration) _liveDuration -= 1;
+}
+
+void rgbSetSpeed(uint16 speed) {
+  if (speed > SPEED_MAX) speed = SPEED_MAX;
+  _speed = speed;
+}
+
+uint8 _paused;
+
+void rgbPause(uint8 pause) {
+  _paused = pause;
+}
+
+void rgbStep() {
+  uint8 track, switching = ctrBlockSwitching();
+
+  for (track = 0; track <= OVERLAY; track++) {
+    if (!PLAYING(track)) continue;
+    nextStep(track);
+
+    // a commit took effect, and every track has started on the new bank
+    if (switching && !ctrBlockSwitching()) break;
+  }
+}
+
+void rgbOverlay(uint8 seqId, uint8 blend, uint8 alpha) {
+  ControlBlock *cb;
+  uint8 i;
+
+  if (seqId == NO_OVERLAY || !(cb = ctrBlockOverlay(seqId))) {
+    ctrBlockStopOverlay();
+    return;
+  }
+
+  // the overlay fades in from the colour of the base layer
+  for (i = 0; i < 3; i++) _colour[OVERLAY_CHANNEL + i] = _colour[i];
+  startStep(OVERLAY, cb);
+  _owed[OVERLAY] = 0;
+
+  _blend = blend;
+  _alpha = alpha;
+}
+
+/**
+ * Lay over onto base. Fixed point, with an alpha of 255 taken as 1.
+ */
+uint8 blend(uint8 base, uint8 over) {
+  uint16 alpha = _alpha + (_alpha >> 7);
+  uint16 v;
+
+  over = ((uint16)over * alpha) >> 8;
+
+  switch (_blend) {
+    case BLEND_MAX:
+      return over > base ? over : base;
+
+    case BLEND_ADD:
+      v = base + over;
+      return v > UINT8_MAX ? UINT8_MAX : v;
+
+    default:
+      return (((uint16)base * (256 - alpha)) >> 8) + over;
+  }
+}
+
+uint8 rgbPatch(uint8 track, ControlBlock *cb) {
+  if (_live || !(cb = ctrBlockPatch(track, cb))) return 0;
+
+  // show the new colour straight away, even while paused, and hold it for
+  // the units left in the step
+  copyColors(track, cb);
+  return 1;
+}
+
+void rgbGoto(uint8 blockNumber, uint16 fade) {
+  if (!ctrBlockGoto(blockNumber)) return;
+
+  // only track 0 moves, but the others of a split sequence fade from
+  // wherever they are too, and units owed from before count for none
+  _live = 0;
+  startTracks(fade);
+}
+
+void rgbGotoSequence(uint8 seqId, uint16 fade) {
+  if (!ctrBlockGotoSequence(seqId)) return;
+
+  _live = 0;
+  startTracks(fade);
+}
+
+/**
+ * Play track through from the start of its sequence for units. Returns
+ * zero if that takes more than SEEK_MAX_STEPS steps, and leaves the track
+ * at the start of the step it got to.
+ */
+uint8 seekTrack(uint8 track, uint16 units) {
+  ControlBlock *cb = ctrBlockCurrent(track);
+  uint16 pass = 0;
+  uint32 length;
+  uint8 n;
+
+  // the first step holds its colour, as after a restart
+  copyColors(track, cb);
+
+  for (n = 0; ; n++) {
+    length = (uint32)ctrBlockDuration(track) * ctrBlockPrescale(track);
+    if (units < length) break;
+
+    // give up rather than stall USB, e.g. in a long run of steps of no
+    // duration
+    if (n == SEEK_MAX_STEPS) {
+      startStep(track, cb);
+      return 0;
+    }
+
+    // only the colour each step ends on matters, so the fades on the way
+    // are never worked out
+    units -= length;
+    pass += length;
+    copyColors(track, cb);
+    cb = ctrBlockNext(track);
+
+    if (ctrBlockEvents() & TELEMETRY_END) {
+      ctrBlockClearEvents();
+
+      // a sequence which plays once holds its last colour from here on,
+      // otherwise whole passes of it are skipped
+      if (ctrBlockEnded(track) || pass == 0) {
+        units = 0;
+        break;
+      }
+      units %= pass;
+    }
+  }
+
+  // move part way into the step, as rgbPoll() would have
+  startStep(track, cb);
+  _prescaleCount[track] = PRESCALE(track) - units % PRESCALE(track);
+  _duration[track] -= units / PRESCALE(track);
+  return 1;
+}
+
+uint8 rgbSeek(uint16 units) {
+  uint8 track, found = 1;
+
+  if (!ctrBlockGotoSequence(ctrBlockSequence())) return 0;
+
+  _live = 0;
+  ctrBlockSeek(1);
+  for (track = 0; track < ctrBlockTracks(); track++)
+    if (!seekTrack(track, units)) found = 0;
+  ctrBlockSeek(0);
+
+  _speedCount = 0;
+  clearOwed();
+  return found;
 }
 
 void rgbSetup() {
+  uint8 track;
+
   _error = 0;
-  ControlBlock *cb = ctrBlockSetup();
-  if (cb) {
-    _r = cb->r;
-    _g = cb->g;
-    _b = cb->b;
-    _duration = cb->duration;
+  _paused = 0;
+  _live = 0;
+  _speed = SPEED_ONE;
+  _speedCount = 0;
+  if (ctrBlockSetup()) {
+    // the first steps hold their colour
+    for (track = 0; track < ctrBlockTracks(); track++)
+      copyColors(track, ctrBlockCurrent(track));
+    startTracks(NO_CROSSFADE);
   } else _error = 1;
 
   // Setup timer1 to use system block divded by 16384.
@@ -187,11 +591,110 @@ void rgbSetup() {
   if (_error == 0) IO_PORT = 0;
 }
 
-int16 _dr, _dg, _db;
 uint8 _pollCounter;
 uint16 _lastms;
+uint16 _lastTick;
+
+// the colour shown, which is the colour the blocks give with the effect
+// applied. It is worked out once per tick, so that the PWM loop stays fast.
+uint8 _out[3];
+
+uint16 rgbTicks() {
+  uint16 ticks;
+
+  // the timer interrupt may change either byte while we read them
+  cli();
+  ticks = _ticks;
+  sei();
+  return ticks;
+}
+
+// TELEMETRY_ERROR and TELEMETRY_RUNAWAY as of the last packet
+uint8 _reported;
+
+uint8 errorFlags() {
+  uint8 flags = 0;
+
+  if (_error) flags |= TELEMETRY_ERROR;
+  if (ctrBlockRunaway()) flags |= TELEMETRY_RUNAWAY;
+  return flags;
+}
+
+uint8 rgbEvents() {
+  return ctrBlockEvents() | (errorFlags() & ~_reported);
+}
+
+void rgbTelemetry(uint8 *report) {
+  uint16 ticks = rgbTicks();
+  uint8 flags = errorFlags();
+
+  _reported = flags;
+
+  report[TELEMETRY_RGB] = _out[0];
+  report[TELEMETRY_RGB + 1] = _out[1];
+  report[TELEMETRY_RGB + 2] = _out[2];
+  report[TELEMETRY_BLOCK] = ctrBlockNumber();
+  report[TELEMETRY_SEQ] = ctrBlockSequence();
+  report[TELEMETRY_TICKS] = ticks & 0xff;
+  report[TELEMETRY_TICKS + 1] = ticks >> 8;
+
+  if (_paused) flags |= TELEMETRY_PAUSED;
+  if (ctrBlockOverlayActive()) flags |= TELEMETRY_OVERLAY;
+  if (ctrBlockSwitching()) flags |= TELEMETRY_SWITCHING;
+  report[TELEMETRY_FLAGS] = flags | ctrBlockEvents();
+  ctrBlockClearEvents();
+}
+
+/**
+ * Work out the colour shown from the base layer, the effect and the
+ * overlay
+ */
+void updateOutput() {
+  uint8 track;
+
+  if (_live) fadeColours(0, 3, &_liveFrame, _liveTotal, _liveDuration);
+  for (track = 0; track <= OVERLAY; track++) {
+    if (PLAYING(track))
+      fadeColours(FIRST_CHANNEL(track), LAST_CHANNEL(track),
+                  ctrBlockCurrent(track), _total[track], _duration[track]);
+  }
+
+  _out[0] = _colour[0];
+  _out[1] = _colour[1];
+  _out[2] = _colour[2];
+
+  // live frames are shown as they are
+  if (!_live) effectApply(_out);
+
+  if (ctrBlockOverlayActive()) {
+    _out[0] = blend(_out[0], _colour[OVERLAY_CHANNEL]);
+    _out[1] = blend(_out[1], _colour[OVERLAY_CHANNEL + 1]);
+    _out[2] = blend(_out[2], _colour[OVERLAY_CHANNEL + 2]);
+  }
+}
+
+void rgbLive(uint8 r, uint8 g, uint8 b, uint16 fade) {
+  uint8 i;
+
+  _liveFrame.r = r;
+  _liveFrame.g = g;
+  _liveFrame.b = b;
+  _liveTotal = fade;
+  _liveDuration = fade;
+  _liveTick = rgbTicks();
+
+  // fade from whatever is shown, which fadeColours() lands on the frame
+  // straight away if fade is zero
+  for (i = 0; i < 3; i++) _from[i] = _colour[i];
+  _live = 1;
+
+  // show it now rather than at the next tick
+  updateOutput();
+}
 
 void rgbPoll() {
+  uint8 track, units;
+
   if (_error) {
     LED_ON(PIN_R);
     return;
@@ -201,36 +704,60 @@ void rgbPoll() {
 
   if (msSince(_lastms) > MS_PER_UNIT_DURATION) {
     _lastms = _elapsedTime.ms;
-    _duration -= 1;
-
-    _r = adjIntensity(_r, _dr);
-    _g = adjIntensity(_g, _dg);
-    _b = adjIntensity(_b, _db);
-
+    if (_live) liveUnit();
+
+    // owe each track the whole units the speed gives, and keep the
+    // fraction for next time. Each track uses its own below, so a track
+    // which is between steps does not hold the others up.
+    if (!_paused) {
+      _speedCount += _speed;
+      units = _speedCount / SPEED_ONE;
+      _speedCount %= SPEED_ONE;
+
+      for (track = 0; track <= OVERLAY; track++) {
+        if (!PLAYING(track)) continue;
+        _owed[track] = units > UINT8_MAX - _owed[track] ?
+                       UINT8_MAX : _owed[track] + units;
+      }
+    }
   }
 
-  pwm(_pollCounter, _r, PIN_R);
-  pwm(_pollCounter, _g, PIN_G);
-  pwm(_pollCounter, _b, PIN_B);
+  if (_elapsedTime.ms != _lastTick) {
+    _lastTick = _elapsedTime.ms;
+    if (!_paused) effectTick(_speed);
 
-  if (_duration == 0) {
-    // first set ourselves to the value the control block specified, since we
-    // probably didn't hit it due to founding errors.
-    ControlBlock *cb = ctrBlockCurrent();
-    copyColors(cb);
+    // the host has stopped sending frames, so fade back into the step
+    // each track was on
+    if (_live && (uint16)(rgbTicks() - _liveTick) >= LIVE_TIMEOUT) {
+      _live = 0;
+      startTracks(LIVE_RESUME_FADE);
+    }
 
-    cb = ctrBlockNext();
-    _duration = cb->duration;
-
-    if (_duration) {
-      _dr = calcColorDelta(_r, cb->r, _duration);
-      _dg = calcColorDelta(_g, cb->g, _duration);
-      _db = calcColorDelta(_b, cb->b, _duration);
-
-      if (_dr == 0) _r = (cb->r+_r)/2;
-      if (_dg == 0) _g = (cb->g+_g)/2;
-      if (_db == 0) _b = (cb->b+_b)/2;
+    updateOutput();
+  }
 
-    } else copyColors(cb);
+  pwm(_pollCounter, _out[0], PIN_R);
+  pwm(_pollCounter, _out[1], PIN_G);
+  pwm(_pollCounter, _out[2], PIN_B);
+
+  // a step of no duration is over before it starts. Units left over when
+  // a step ends carry on into the next one.
+  if (!_paused) {
+    for (track = 0; track <= OVERLAY; track++) {
+      if (!PLAYING(track)) continue;
+
+      // the next step may be read from EEPROM. Rather than wait for a
+      // write in progress, and stall the PWM, try again next time around.
+      if (_duration[track] == 0) {
+        if (!eeStoreHold()) continue;
+        nextStep(track);
+        eeStoreResume();
+      }
+
+      while (_owed[track] && _duration[track]) {
+        _owed[track] -= 1;
+        consumeUnit(track);
+      }
+    }
   }
 }
@@ -1,2 +1,65 @@
+#include "types.h"
+
 void rgbSetup();
 void rgbPoll();
+/**
+ * Set the playback speed, in 8.8 fixed point, see CMD_SPEED
+ */
+void rgbSetSpeed(uint16 speed);
+/**
+ * Stop time if pause is non-zero, otherwise carry on
+ */
+void rgbPause(uint8 pause);
+/**
+ * Jump to the end of the current step, and start the next one. Useful
+ * while paused.
+ */
+void rgbStep();
+/**
+ * Like ctrBlockGoto() and ctrBlockGotoSequence(), but fade to the new
+ * step from the colour being shown. The fade takes fade units of
+ * MS_PER_UNIT_DURATION, or the duration of the step if fade is
+ * NO_CROSSFADE.
+ */
+#define NO_CROSSFADE        (0xffff)
+void rgbGoto(uint8 blockNumber, uint16 fade);
+void rgbGotoSequence(uint8 seqId, uint16 fade);
+/**
+ * Play seqId once over the top of the sequence which is playing, combined
+ * with it as given by blend and alpha, see CMD_OVERLAY. NO_OVERLAY stops
+ * the overlay.
+ */
+#define NO_OVERLAY          (0xff)
+void rgbOverlay(uint8 seqId, uint8 blend, uint8 alpha);
+/**
+ * Show r, g, b instead of the base layer, fading to it over fade units of
+ * MS_PER_UNIT_DURATION, until LIVE_TIMEOUT passes without another call
+ */
+void rgbLive(uint8 r, uint8 g, uint8 b, uint16 fade);
+/**
+ * Like ctrBlockPatch(), and show the new colour at once for the rest of
+ * the step. Returns zero if the step cannot be patched, e.g. during live
+ * frames.
+ */
+uint8 rgbPatch(uint8 track, ControlBlock *cb);
+/**
+ * Play the current sequence from units of MS_PER_UNIT_DURATION after its
+ * start, with the colour part way through the fade as it would be. Returns
+ * zero if a track needs more than SEEK_MAX_STEPS steps to get there.
+ */
+uint8 rgbSeek(uint16 units);
+/**
+ * Return the number of 10ms ticks since the device started, which wraps
+ * around
+ */
+uint16 rgbTicks();
+/**
+ * Fill report with a TELEMETRY_SIZE byte telemetry packet, see config.h.
+ * The events it carries are cleared.
+ */
+void rgbTelemetry(uint8 *report);
+/**
+ * Return the telemetry flags which have been raised since the last packet,
+ * and should push the next one early
+ */
+uint8 rgbEvents();
@@ -0,0 +1,16 @@
+#include <avr/pgmspace.h>
+
+#include "types.h"
+
+#ifndef _SEQLIB_H
+#define _SEQLIB_H
+/**
+ * The sequence library lives in flash and is generated by seqlib.py from
+ * the .seq files in seqlib/, see the Makefile. seqLibDir uses the same
+ * entry format as the EEPROM directory, with start being an offset into
+ * seqLibBlocks.
+ */
+extern PROGMEM const uint8 seqLibEntries;
+extern PROGMEM const SeqDirEntry seqLibDir[];
+extern PROGMEM const uint8 seqLibBlocks[];
+#endif
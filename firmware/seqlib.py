@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+"""
+Builds the sequence library that is stored in flash.
+
+Takes a list of .seq files, in the same format upload_seq.py reads but
+without the setup block, and writes the C source for the library to
+stdout. Sequences are numbered from SEQLIB_FIRST_ID in the order the files
+are given.
+"""
+
+import sys
+
+BLOCK_SIZE = 4
+
+def readseq(path):
+  hexbytes = []
+  with open(path) as f:
+    for line in f.readlines():
+      line = line.split('#',1)[0].strip()
+      if len(line):
+        hexbytes += [int(hb,16) for hb in line.split()]
+
+  if len(hexbytes) == 0 or len(hexbytes) % BLOCK_SIZE:
+    raise ValueError("%s is not a whole number of blocks" % path)
+  if len(hexbytes) // BLOCK_SIZE > 0xff:
+    raise ValueError("%s has more than 255 blocks" % path)
+  return hexbytes
+
+def main(args):
+  blocks = []
+  entries = []
+  for path in args:
+    try:
+      seq = readseq(path)
+    except Exception as ex:
+      sys.stderr.write("%s\n" % ex)
+      return 1
+    entries.append((len(blocks), len(seq) // BLOCK_SIZE, path))
+    blocks += seq
+
+  out = sys.stdout
+  out.write("/* generated by seqlib.py, do not edit */\n")
+  out.write('#include "config.h"\n#include "seqlib.h"\n\n')
+  out.write("PROGMEM const uint8 seqLibEntries = %d;\n\n" % len(entries))
+
+  out.write("PROGMEM const SeqDirEntry seqLibDir[] = {\n")
+  for n, (start, length, path) in enumerate(entries):
+    out.write("  {0x%04x, 0x%02x, 0x00},   // SEQLIB_FIRST_ID+%d: %s\n" %
+        (start, length, n, path))
+  if not entries:
+    out.write("  {0, 0, 0},\n")
+  out.write("};\n\n")
+
+  out.write("PROGMEM const uint8 seqLibBlocks[] = {\n")
+  for i in range(0, len(blocks), BLOCK_SIZE):
+    out.write("  %s,\n" % ", ".join("0x%02x" % b for b in blocks[i:i+BLOCK_SIZE]))
+  if not blocks:
+    out.write("  0,\n")
+  out.write("};\n")
+  return 0
+
+if __name__ == '__main__':
+  sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,40 @@
+/* Stack high-water mark.
+ *
+ * Static RAM and the stack share the tiny85's 512 bytes. Everything between
+ * the end of static RAM and the top of the stack is painted with
+ * STACK_PAINT before the C runtime starts, and stackUnused() counts how
+ * much of that has never been overwritten.
+ */
+#include "stack.h"
+
+#define STACK_PAINT         (0xc5)
+
+// placed by the linker
+extern uint8 _end;
+extern uint8 __stack;
+
+// runs from .init1, before the stack pointer and r1 are set up, so it is
+// written in assembly and may only use the registers it loads itself
+void stackPaint() __attribute__((naked, used, section(".init1")));
+void stackPaint() {
+  __asm__ __volatile__ (
+    "    ldi r30, lo8(_end)\n"
+    "    ldi r31, hi8(_end)\n"
+    "    ldi r24, %0\n"
+    "    ldi r25, hi8(__stack)\n"
+    "    rjmp 2f\n"
+    "1:  st Z+, r24\n"
+    "2:  cpi r30, lo8(__stack)\n"
+    "    cpc r31, r25\n"
+    "    brlo 1b\n"
+    "    breq 1b\n"
+    :: "M" (STACK_PAINT));
+}
+
+uint8 stackUnused() {
+  const uint8 *p = &_end;
+  uint8 n = 0;
+
+  while (n < 254 && p <= &__stack && *p++ == STACK_PAINT) n++;
+  return n;
+}
@@ -0,0 +1,11 @@
+#include "types.h"
+
+#ifndef _STACK_H
+#define _STACK_H
+/**
+ * Return the number of bytes between the end of static RAM and the deepest
+ * the stack has reached since reset, at most 254. RAM is painted before
+ * main() runs, so this is the stack headroom left by the worst case seen.
+ */
+uint8 stackUnused();
+#endif
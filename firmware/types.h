@@ -6,6 +6,8 @@
 typedef uint8_t uint8;
 typedef uint16_t uint16;
 typedef int16_t int16;
+typedef int32_t int32;
+typedef uint32_t uint32;
 
 typedef struct {
   uint16 ms;
@@ -21,4 +23,10 @@ typedef struct {
     uint8 options;
   };
 } ControlBlock;
+
+typedef struct {
+  uint16 start;
+  uint8 length;
+  uint8 flags;
+} SeqDirEntry;
 #endif
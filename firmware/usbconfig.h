@@ -107,10 +107,12 @@ section at the end of this file).
  * (e.g. HID), but never want to send any data. This option saves a couple
  * of bytes in flash memory and the transmit buffers in RAM.
  */
-#define USB_CFG_INTR_POLL_INTERVAL      100
+#define USB_CFG_INTR_POLL_INTERVAL      10
 /* If you compile a version with endpoint 1 (interrupt-in), this is the poll
  * interval. The value is in milliseconds and must not be less than 10 ms for
  * low speed devices.
+ * Telemetry is pushed on endpoint 1, and this bounds how often the host
+ * takes it, so keep it at the shortest TELEMETRY period we want to allow.
  */
 #define USB_CFG_IS_SELF_POWERED         0
 /* Define this to 1 if the device has its own power supply. Set it to 0 if the
@@ -138,7 +140,7 @@ section at the end of this file).
  * interrupt/bulk data sent to any endpoint other than 0. The endpoint number
  * can be found in 'usbRxToken'.
  */
-#define USB_CFG_HAVE_FLOWCONTROL        0
+#define USB_CFG_HAVE_FLOWCONTROL        1
 /* Define this to 1 if you want flowcontrol over USB data. See the definition
  * of the macros usbDisableAllRequests() and usbEnableAllRequests() in
  * usbdrv.h.
@@ -148,10 +150,17 @@ section at the end of this file).
  * where the driver's constants (descriptors) are located. Or in other words:
  * Define this to 1 for boot loaders on the ATMega128.
  */
+#ifndef USB_CFG_LONG_TRANSFERS
 #define USB_CFG_LONG_TRANSFERS          0
+#endif
 /* Define this to 1 if you want to send/receive blocks of more than 254 bytes
  * in a single control-in or control-out transfer. Note that the capability
  * for long transfers increases the driver size.
+ * This is set from LONG_TRANSFERS in the Makefile, which lets a whole EEPROM
+ * image go up or down in one feature report. Writing the 512 bytes with
+ * hidtool then takes 1 transfer of 67 transactions instead of 3 of 72 in
+ * all, and reading them 2 transfers of 70 instead of 6 of 80, so the host
+ * turns around between transfers less often. "hidtool bench" times both.
  */
 /* #define USB_RX_USER_HOOK(data, len)     if(usbRxToken == (uchar)USBPID_SETUP) blinkLED(); */
 /* This macro is a hook if you want to do unconventional things. If it is
@@ -280,7 +289,11 @@ extern void hadUsbReset(void); // define the function for usbdrv.c
  * HID class is 3, no subclass and protocol required (but may be useful!)
  * CDC class is 2, use subclass 2 and protocol 1 for ACM
  */
-#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    22
+#if USB_CFG_LONG_TRANSFERS
+#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    78
+#else
+#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    77
+#endif
 /* Define this to the length of the HID report descriptor, if you implement
  * an HID device. Otherwise don't define it or define it to 0.
  * If you use this define, you must add a PROGMEM character array named